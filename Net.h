@@ -26,6 +26,9 @@ const int PacketSizeHack = 256 + 128;
 
 #if PLATFORM == PLATFORM_WINDOWS
 
+#ifndef NOMINMAX
+#define NOMINMAX	// windows.h's min and max macros break std::min and std::max
+#endif
 #include <winsock2.h>
 #pragma comment( lib, "wsock32.lib" )
 
@@ -34,6 +37,28 @@ const int PacketSizeHack = 256 + 128;
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <netinet/udp.h>
+#include <errno.h>
+#include <stdint.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef SO_TXTIME
+#define SO_TXTIME 61
+#define SCM_TXTIME SO_TXTIME
+#endif
+#else
+#include <sys/select.h>
+#endif
 
 #else
 
@@ -45,9 +70,10 @@ const int PacketSizeHack = 256 + 128;
 #include <vector>
 #include <map>
 #include <stack>
-#include <list>
 #include <algorithm>
+#include <cmath>
 #include <functional>
+#include <chrono>
 
 namespace net
 {
@@ -67,6 +93,36 @@ namespace net
 
 #endif
 
+	// monotonic time in microseconds, used to timestamp packets
+
+	typedef unsigned long long Timestamp;
+
+	inline Timestamp GetTimestamp()
+	{
+		return (Timestamp)std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// the same clock in nanoseconds, for pacing departure times
+
+	inline unsigned long long GetNanoseconds()
+	{
+		return (unsigned long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	const Timestamp NoDeadline = ~0ULL;
+
+	inline float TimestampToSeconds(Timestamp time)
+	{
+		return (float)(time * 0.000001);
+	}
+
+	inline Timestamp SecondsToTimestamp(float seconds)
+	{
+		return (Timestamp)(seconds * 1000000.0);
+	}
+
 	// internet address
 
 	class Address
@@ -131,6 +187,19 @@ namespace net
 			return !(*this == other);
 		}
 
+		// address and port packed into 48 bits, zero for the empty address
+
+		unsigned long long GetKey() const
+		{
+			return ((unsigned long long)address << 16) | port;
+		}
+
+		size_t Hash() const
+		{
+			unsigned long long hash = GetKey() * 0x9E3779B97F4A7C15ULL;
+			return (size_t)(hash ^ (hash >> 32));
+		}
+
 		bool operator < (const Address& other) const
 		{
 			// note: this is so we can use address as a key in std::map
@@ -148,6 +217,167 @@ namespace net
 		unsigned short port;
 	};
 
+	// flat open addressing hash table keyed by address
+	//  + linear probing over a power of two array, kept at most half full
+	//  + erase shifts later entries back, so there are no tombstones and lookups stay short
+	//  + slots can be walked directly with GetCapacity / IsUsed / GetAddress / GetValue
+
+	template <typename Value> class AddressTable
+	{
+	public:
+
+		AddressTable(int capacity = 16)
+		{
+			count = 0;
+			Resize(capacity);
+		}
+
+		Value* Find(const Address& address)
+		{
+			const int slot = FindSlot(address.GetKey());
+			return slot < 0 ? NULL : &slots[slot].value;
+		}
+
+		const Value* Find(const Address& address) const
+		{
+			const int slot = FindSlot(address.GetKey());
+			return slot < 0 ? NULL : &slots[slot].value;
+		}
+
+		// returns false if the address is already in the table
+
+		bool Insert(const Address& address, const Value& value)
+		{
+			const unsigned long long key = address.GetKey();
+			assert(key != 0);
+			if (FindSlot(key) >= 0)
+				return false;
+			if ((count + 1) * 2 > (int)slots.size())
+				Resize((int)slots.size() * 2);
+			size_t i = address.Hash() & mask;
+			while (slots[i].key != 0)
+				i = (i + 1) & mask;
+			slots[i].key = key;
+			slots[i].value = value;
+			count++;
+			return true;
+		}
+
+		bool Erase(const Address& address)
+		{
+			int slot = FindSlot(address.GetKey());
+			if (slot < 0)
+				return false;
+			size_t i = (size_t)slot;
+			size_t j = i;
+			while (true)
+			{
+				j = (j + 1) & mask;
+				if (slots[j].key == 0)
+					break;
+				// move the entry back into the hole unless its home slot lies cyclically in (i, j]
+				const size_t home = Home(slots[j].key);
+				const bool stays = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+				if (!stays)
+				{
+					slots[i] = slots[j];
+					i = j;
+				}
+			}
+			slots[i].key = 0;
+			slots[i].value = Value();
+			count--;
+			return true;
+		}
+
+		void Clear()
+		{
+			for (size_t i = 0; i < slots.size(); ++i)
+				slots[i] = Slot();
+			count = 0;
+		}
+
+		int Size() const
+		{
+			return count;
+		}
+
+		int GetCapacity() const
+		{
+			return (int)slots.size();
+		}
+
+		bool IsUsed(int slot) const
+		{
+			return slots[slot].key != 0;
+		}
+
+		Address GetAddress(int slot) const
+		{
+			return Address((unsigned int)(slots[slot].key >> 16), (unsigned short)(slots[slot].key & 0xFFFF));
+		}
+
+		Value& GetValue(int slot)
+		{
+			return slots[slot].value;
+		}
+
+		const Value& GetValue(int slot) const
+		{
+			return slots[slot].value;
+		}
+
+	private:
+
+		struct Slot
+		{
+			Slot() : key(0), value() {}
+			unsigned long long key;		// Address::GetKey, zero when the slot is empty
+			Value value;
+		};
+
+		size_t Home(unsigned long long key) const
+		{
+			return Address((unsigned int)(key >> 16), (unsigned short)(key & 0xFFFF)).Hash() & mask;
+		}
+
+		int FindSlot(unsigned long long key) const
+		{
+			if (key == 0)
+				return -1;
+			size_t i = Home(key);
+			while (slots[i].key != 0)
+			{
+				if (slots[i].key == key)
+					return (int)i;
+				i = (i + 1) & mask;
+			}
+			return -1;
+		}
+
+		void Resize(int capacity)
+		{
+			assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+			std::vector<Slot> old;
+			old.swap(slots);
+			slots.resize(capacity);
+			mask = (size_t)capacity - 1;
+			for (size_t i = 0; i < old.size(); ++i)
+			{
+				if (old[i].key == 0)
+					continue;
+				size_t j = Home(old[i].key);
+				while (slots[j].key != 0)
+					j = (j + 1) & mask;
+				slots[j] = old[i];
+			}
+		}
+
+		std::vector<Slot> slots;
+		size_t mask;
+		int count;
+	};
+
 	// sockets
 
 	inline bool InitializeSockets()
@@ -171,9 +401,18 @@ namespace net
 	{
 	public:
 
+		enum { MaxBatchSize = 64 };
+
 		Socket()
 		{
 			socket = 0;
+			offload = false;
+			txtime = false;
+#if defined(__linux__)
+			coalescedSize = 0;
+			coalescedSegment = 0;
+			coalescedOffset = 0;
+#endif
 		}
 
 		~Socket()
@@ -248,6 +487,63 @@ namespace net
 #endif
 				socket = 0;
 			}
+			offload = false;
+			txtime = false;
+#if defined(__linux__)
+			coalescedSize = 0;
+			coalescedOffset = 0;
+#endif
+		}
+
+		// udp segmentation offload (linux only)
+		//  + sends hand the kernel runs of equal size datagrams as one buffer (UDP_SEGMENT)
+		//  + receives may return several coalesced datagrams at once (UDP_GRO), which are split back up here
+		//  + every datagram on the wire is unchanged, so the peer does not need offload enabled
+
+		bool EnableOffload()
+		{
+			assert(IsOpen());
+#if defined(__linux__)
+			int gso_size = 0;
+			if (setsockopt(socket, SOL_UDP, UDP_SEGMENT, &gso_size, sizeof(gso_size)) < 0)
+				return false;
+			int enable = 1;
+			if (setsockopt(socket, SOL_UDP, UDP_GRO, &enable, sizeof(enable)) < 0)
+				return false;
+			coalescedBuffer.resize(MaxCoalescedSize);
+			offload = true;
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		bool IsOffloadEnabled() const
+		{
+			return offload;
+		}
+
+		// departure times (linux only, SO_TXTIME)
+		//  + datagrams sent with a departure time are held back by the kernel until then, on the monotonic clock
+		//  + it takes the fq qdisc on the outgoing interface to honour them, other qdiscs send straight away
+
+		bool EnableTxTime()
+		{
+			assert(IsOpen());
+#if defined(__linux__)
+			struct { int32_t clockid; uint32_t flags; } config = { CLOCK_MONOTONIC, 0 };
+			if (setsockopt(socket, SOL_SOCKET, SO_TXTIME, &config, sizeof(config)) < 0)
+				return false;
+			txtime = true;
+			return true;
+#else
+			return false;
+#endif
+		}
+
+		bool IsTxTimeEnabled() const
+		{
+			return txtime;
 		}
 
 		bool IsOpen() const
@@ -255,6 +551,11 @@ namespace net
 			return socket != 0;
 		}
 
+		int GetHandle() const
+		{
+			return socket;
+		}
+
 		bool Send(const Address& destination, const void* data, int size)
 		{
 			assert(data);
@@ -304,787 +605,4816 @@ namespace net
 			return received_bytes;
 		}
 
-	private:
-
-		int socket;
-	};
+		// sends a datagram at its departure time in nanoseconds (see EnableTxTime), zero means now
 
-	// connection
+		bool Send(const Address& destination, const void* data, int size, unsigned long long departure)
+		{
+#if defined(__linux__)
+			if (departure != 0 && txtime)
+			{
+				const unsigned char* packet = (const unsigned char*)data;
+				return SendBatch(destination, &packet, &size, 1, &departure) == 1;
+			}
+#else
+			(void)departure;	// only linux can hold a datagram back until its departure time
+#endif
+			return Send(destination, data, size);
+		}
 
-	class Connection
-	{
-	public:
+		// sends up to MaxBatchSize datagrams with as few system calls as possible (sendmmsg on linux)
+		//  + departures, if given, holds a departure time for each datagram (see EnableTxTime)
+		//  + returns the number of datagrams sent
 
-		enum Mode
+		int SendBatch(const Address& destination, const unsigned char* const data[], const int sizes[], int count,
+			const unsigned long long departures[] = NULL)
 		{
-			None,
-			Client,
-			Server
-		};
+			assert(count >= 0 && count <= MaxBatchSize);
 
-		Connection(unsigned int protocolId, float timeout)
-		{
-			this->protocolId = protocolId;
-			this->timeout = timeout;
-			mode = None;
-			running = false;
-			ClearData();
-		}
+			if (socket == 0)
+				return 0;
 
-		virtual ~Connection()
-		{
-			if (IsRunning())
-				Stop();
-		}
+#if defined(__linux__)
+			assert(destination.GetAddress() != 0);
+			assert(destination.GetPort() != 0);
 
-		bool Start(int port)
-		{
-			assert(!running);
-			printf("start connection on port %d\n", port);
-			if (!socket.Open(port))
-				return false;
-			running = true;
-			OnStart();
-			return true;
-		}
+			sockaddr_in address;
+			address.sin_family = AF_INET;
+			address.sin_addr.s_addr = htonl(destination.GetAddress());
+			address.sin_port = htons((unsigned short)destination.GetPort());
 
-		void Stop()
-		{
-			assert(running);
-			printf("stop connection\n");
-			bool connected = IsConnected();
-			ClearData();
-			socket.Close();
-			running = false;
-			if (connected)
-				OnDisconnect();
-			OnStop();
-		}
+			for (int i = 0; i < count; ++i)
+			{
+				vectors[i].iov_base = (void*)data[i];
+				vectors[i].iov_len = sizes[i];
+			}
 
-		bool IsRunning() const
-		{
-			return running;
-		}
+			if (!txtime)
+				departures = NULL;
 
-		void Listen()
-		{
-			printf("server listening for connection\n");
-			bool connected = IsConnected();
-			ClearData();
-			if (connected)
-				OnDisconnect();
-			mode = Server;
-			state = Listening;
-		}
+			// a segmented send leaves as one unit, so datagrams with their own departure times go one message each
+			if (offload && !departures)
+			{
+				int sent = SendSegmented(address, sizes, count);
+				if (sent >= 0)
+					return sent;
+			}
 
-		void Connect(const Address& address)
-		{
-			printf("client connecting to %d.%d.%d.%d:%d\n",
-				address.GetA(), address.GetB(), address.GetC(), address.GetD(), address.GetPort());
-			bool connected = IsConnected();
-			ClearData();
-			if (connected)
-				OnDisconnect();
-			mode = Client;
-			state = Connecting;
-			this->address = address;
-		}
+			for (int i = 0; i < count; ++i)
+			{
+				std::memset(&messages[i], 0, sizeof(messages[i]));
+				messages[i].msg_hdr.msg_name = &address;
+				messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+				messages[i].msg_hdr.msg_iov = &vectors[i];
+				messages[i].msg_hdr.msg_iovlen = 1;
+				if (departures && departures[i] != 0)
+				{
+					msghdr& header = messages[i].msg_hdr;
+					header.msg_control = timeControls[i].buffer;
+					header.msg_controllen = sizeof(timeControls[i].buffer);
+					cmsghdr* control = CMSG_FIRSTHDR(&header);
+					control->cmsg_level = SOL_SOCKET;
+					control->cmsg_type = SCM_TXTIME;
+					control->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+					const uint64_t departure = departures[i];
+					std::memcpy(CMSG_DATA(control), &departure, sizeof(departure));
+				}
+			}
 
-		bool IsConnecting() const
-		{
-			return state == Connecting;
+			int sent = 0;
+			while (sent < count)
+			{
+				int result = sendmmsg(socket, &messages[sent], count - sent, 0);
+				if (result <= 0)
+					break;
+				sent += result;
+			}
+			return sent;
+#else
+			(void)departures;
+			int sent = 0;
+			while (sent < count && Send(destination, data[sent], sizes[sent]))
+				sent++;
+			return sent;
+#endif
 		}
 
-		bool ConnectFailed() const
-		{
-			return state == ConnectFail;
-		}
+		// receives up to count datagrams of at most size bytes each (recvmmsg on linux)
+		//  + returns the number of datagrams received, zero if there was nothing to read
 
-		bool IsConnected() const
+		int ReceiveBatch(Address senders[], unsigned char* const data[], int size, int sizes[], int count)
 		{
-			return state == Connected;
-		}
+			assert(count >= 0 && count <= MaxBatchSize);
+			assert(size > 0);
 
-		bool IsListening() const
-		{
-			return state == Listening;
-		}
+			if (socket == 0)
+				return 0;
 
-		Mode GetMode() const
-		{
-			return mode;
-		}
+#if defined(__linux__)
+			if (offload)
+				return ReceiveCoalesced(senders, data, size, sizes, count);
 
-		virtual void Update(float deltaTime)
-		{
-			assert(running);
-			timeoutAccumulator += deltaTime;
-			if (timeoutAccumulator > timeout)
+			for (int i = 0; i < count; ++i)
 			{
-				if (state == Connecting)
+				vectors[i].iov_base = data[i];
+				vectors[i].iov_len = size;
+				std::memset(&messages[i], 0, sizeof(messages[i]));
+				messages[i].msg_hdr.msg_name = &addresses[i];
+				messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+				messages[i].msg_hdr.msg_iov = &vectors[i];
+				messages[i].msg_hdr.msg_iovlen = 1;
+			}
+
+			int received = recvmmsg(socket, messages, count, 0, NULL);
+			if (received <= 0)
+				return 0;
+
+			for (int i = 0; i < received; ++i)
+			{
+				senders[i] = Address(ntohl(addresses[i].sin_addr.s_addr), ntohs(addresses[i].sin_port));
+				sizes[i] = (int)messages[i].msg_len;
+			}
+			return received;
+#else
+			int received = 0;
+			while (received < count)
+			{
+				int bytes = Receive(senders[received], data[received], size);
+				if (bytes <= 0)
+					break;
+				sizes[received++] = bytes;
+			}
+			return received;
+#endif
+		}
+
+	private:
+
+#if defined(__linux__)
+
+		enum
+		{
+			MaxSegments = 64,					// kernel limit on datagrams per segmented send
+			MaxCoalescedSize = 65535
+		};
+
+		union SegmentControl
+		{
+			char buffer[CMSG_SPACE(sizeof(uint16_t))];
+			cmsghdr align;
+		};
+
+		union TimeControl
+		{
+			char buffer[CMSG_SPACE(sizeof(uint64_t))];
+			cmsghdr align;
+		};
+
+		// groups consecutive equal size datagrams (the last of a run may be shorter) into one message each
+		//  + returns -1 if the kernel refuses segmentation, in which case offload is switched off
+
+		int SendSegmented(sockaddr_in& address, const int sizes[], int count)
+		{
+			int runs[MaxBatchSize];
+			int message_count = 0;
+			int i = 0;
+			while (i < count)
+			{
+				const int first = i;
+				const int segment = sizes[i++];
+				while (i < count && i - first < MaxSegments && sizes[i] == segment)
+					i++;
+				if (i < count && i - first < MaxSegments && sizes[i] < segment)
+					i++;
+
+				msghdr& header = messages[message_count].msg_hdr;
+				std::memset(&messages[message_count], 0, sizeof(messages[message_count]));
+				header.msg_name = &address;
+				header.msg_namelen = sizeof(sockaddr_in);
+				header.msg_iov = &vectors[first];
+				header.msg_iovlen = i - first;
+				if (i - first > 1)
 				{
-					printf("connect timed out\n");
-					ClearData();
-					state = ConnectFail;
-					OnDisconnect();
+					header.msg_control = controls[message_count].buffer;
+					header.msg_controllen = sizeof(controls[message_count].buffer);
+					cmsghdr* control = CMSG_FIRSTHDR(&header);
+					control->cmsg_level = SOL_UDP;
+					control->cmsg_type = UDP_SEGMENT;
+					control->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+					const uint16_t segment_size = (uint16_t)segment;
+					std::memcpy(CMSG_DATA(control), &segment_size, sizeof(segment_size));
 				}
-				else if (state == Connected)
+				runs[message_count++] = i - first;
+			}
+
+			int sent_messages = 0;
+			int sent = 0;
+			while (sent_messages < message_count)
+			{
+				int result = sendmmsg(socket, &messages[sent_messages], message_count - sent_messages, 0);
+				if (result <= 0)
 				{
-					printf("connection timed out\n");
-					ClearData();
-					if (state == Connecting)
-						state = ConnectFail;
-					OnDisconnect();
+					if (sent_messages == 0 && (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP))
+					{
+						printf("udp segmentation offload not supported, disabling it\n");
+						offload = false;
+						return -1;
+					}
+					break;
 				}
+				for (int j = 0; j < result; ++j)
+					sent += runs[sent_messages + j];
+				sent_messages += result;
 			}
+			return sent;
 		}
 
-		virtual bool SendPacket(const unsigned char data[], int size)
+		// hands out datagrams from the last coalesced receive, reading another one whenever it runs dry
+
+		int ReceiveCoalesced(Address senders[], unsigned char* const data[], int size, int sizes[], int count)
 		{
-			assert(running);
-			if (address.GetAddress() == 0)
+			int received = 0;
+			while (received < count)
+			{
+				if (coalescedOffset >= coalescedSize && !ReadCoalesced())
+					break;
+				const int segment = std::min(coalescedSegment, coalescedSize - coalescedOffset);
+				const int bytes = std::min(segment, size);
+				std::memcpy(data[received], &coalescedBuffer[coalescedOffset], bytes);
+				sizes[received] = bytes;
+				senders[received] = coalescedSender;
+				coalescedOffset += segment;
+				received++;
+			}
+			return received;
+		}
+
+		bool ReadCoalesced()
+		{
+			iovec vector;
+			vector.iov_base = &coalescedBuffer[0];
+			vector.iov_len = coalescedBuffer.size();
+			sockaddr_in from;
+			union
+			{
+				char buffer[CMSG_SPACE(sizeof(int))];
+				cmsghdr align;
+			} control;
+			msghdr header;
+			std::memset(&header, 0, sizeof(header));
+			header.msg_name = &from;
+			header.msg_namelen = sizeof(from);
+			header.msg_iov = &vector;
+			header.msg_iovlen = 1;
+			header.msg_control = control.buffer;
+			header.msg_controllen = sizeof(control.buffer);
+
+			const int bytes = (int)recvmsg(socket, &header, 0);
+			if (bytes <= 0)
 				return false;
-			unsigned char packet[PacketSizeHack + 4];
-			packet[0] = (unsigned char)(protocolId >> 24);
-			packet[1] = (unsigned char)((protocolId >> 16) & 0xFF);
-			packet[2] = (unsigned char)((protocolId >> 8) & 0xFF);
-			packet[3] = (unsigned char)((protocolId) & 0xFF);
-			std::memcpy(&packet[4], data, size);
-			return socket.Send(address, packet, size + 4);
+
+			coalescedSize = bytes;
+			coalescedSegment = bytes;
+			coalescedOffset = 0;
+			coalescedSender = Address(ntohl(from.sin_addr.s_addr), ntohs(from.sin_port));
+			for (cmsghdr* cmsg = CMSG_FIRSTHDR(&header); cmsg != NULL; cmsg = CMSG_NXTHDR(&header, cmsg))
+			{
+				if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+				{
+					int segment;
+					std::memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+					if (segment > 0)
+						coalescedSegment = segment;
+				}
+			}
+			return true;
 		}
 
-		virtual int ReceivePacket(unsigned char data[], int size)
+#endif
+
+		int socket;
+		bool offload;
+		bool txtime;
+
+#if defined(__linux__)
+		mmsghdr messages[MaxBatchSize];			// preallocated so batches never allocate
+		iovec vectors[MaxBatchSize];
+		sockaddr_in addresses[MaxBatchSize];
+		SegmentControl controls[MaxBatchSize];
+		TimeControl timeControls[MaxBatchSize];
+
+		std::vector<unsigned char> coalescedBuffer;		// last receive when offload is enabled, may hold several datagrams
+		int coalescedSize;
+		int coalescedSegment;
+		int coalescedOffset;
+		Address coalescedSender;
+#endif
+	};
+
+	// sleeps until a socket is readable or a deadline passes
+	//  + on linux the socket and a timerfd armed with the deadline are waited on with epoll
+	//  + elsewhere falls back to select with a timeout
+
+	class SocketWaiter
+	{
+	public:
+
+		SocketWaiter()
 		{
-			assert(running);
-			unsigned char packet[PacketSizeHack + 4];
-			Address sender;
-			int bytes_read = socket.Receive(sender, packet, size + 4);
-			if (bytes_read == 0)
-				return 0;
-			if (bytes_read <= 4)
+			socket = 0;
+#if defined(__linux__)
+			epoll = -1;
+			timer = -1;
+#endif
+		}
+
+		~SocketWaiter()
+		{
+			Close();
+		}
+
+		bool Open(const Socket& socket)
+		{
+			assert(socket.IsOpen());
+			Close();
+			this->socket = socket.GetHandle();
+#if defined(__linux__)
+			epoll = epoll_create1(0);
+			timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+			if (epoll < 0 || timer < 0)
+			{
+				printf("failed to create socket waiter\n");
+				Close();
+				return false;
+			}
+			epoll_event event;
+			event.events = EPOLLIN;
+			event.data.fd = this->socket;
+			if (epoll_ctl(epoll, EPOLL_CTL_ADD, this->socket, &event) < 0)
+			{
+				printf("failed to add socket to waiter\n");
+				Close();
+				return false;
+			}
+			event.data.fd = timer;
+			if (epoll_ctl(epoll, EPOLL_CTL_ADD, timer, &event) < 0)
+			{
+				printf("failed to add timer to waiter\n");
+				Close();
+				return false;
+			}
+#endif
+			return true;
+		}
+
+		void Close()
+		{
+#if defined(__linux__)
+			if (timer >= 0)
+				close(timer);
+			if (epoll >= 0)
+				close(epoll);
+			timer = -1;
+			epoll = -1;
+#endif
+			socket = 0;
+		}
+
+		// returns true if the socket became readable, false if the deadline passed first
+
+		bool Wait(Timestamp deadline)
+		{
+			assert(socket != 0);
+#if defined(__linux__)
+			itimerspec spec;
+			std::memset(&spec, 0, sizeof(spec));
+			if (deadline != NoDeadline)
+			{
+				// steady_clock is CLOCK_MONOTONIC, so timestamps can be used as absolute timer values
+				spec.it_value.tv_sec = (time_t)(deadline / 1000000);
+				spec.it_value.tv_nsec = (long)(deadline % 1000000) * 1000;
+				if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0)
+					spec.it_value.tv_nsec = 1;
+			}
+			timerfd_settime(timer, TFD_TIMER_ABSTIME, &spec, NULL);
+
+			epoll_event events[2];
+			int count = epoll_wait(epoll, events, 2, -1);
+			bool readable = false;
+			for (int i = 0; i < count; ++i)
+			{
+				if (events[i].data.fd == socket)
+					readable = true;
+				else if (events[i].data.fd == timer)
+				{
+					unsigned long long expirations;
+					ssize_t result = read(timer, &expirations, sizeof(expirations));
+					(void)result;
+				}
+			}
+			return readable;
+#else
+			timeval timeout;
+			timeval* timeout_pointer = NULL;
+			if (deadline != NoDeadline)
+			{
+				const Timestamp now = GetTimestamp();
+				const Timestamp remaining = deadline > now ? deadline - now : 0;
+				timeout.tv_sec = (long)(remaining / 1000000);
+				timeout.tv_usec = (long)(remaining % 1000000);
+				timeout_pointer = &timeout;
+			}
+			fd_set readable;
+			FD_ZERO(&readable);
+			FD_SET(socket, &readable);
+			return select(socket + 1, &readable, NULL, NULL, timeout_pointer) > 0;
+#endif
+		}
+
+	private:
+
+		int socket;
+#if defined(__linux__)
+		int epoll;
+		int timer;
+#endif
+	};
+
+	// pool of fixed size packet buffers with headroom in front of the payload for each layer's header
+	//  + buffers are carved out of blocks that live as long as the pool, so once warmed up acquire and release never allocate
+
+	class PacketPool
+	{
+	public:
+
+		enum
+		{
+			Headroom = 64,							// connection protocol id + the largest reliability header
+			BufferSize = Headroom + PacketSizeHack,
+			BlockSize = 64							// buffers allocated at a time when the pool runs dry
+		};
+
+		struct Buffer
+		{
+			Buffer* next;							// free list link while the buffer is in the pool
+			int size;								// payload size in bytes
+			unsigned char data[BufferSize];
+
+			unsigned char* GetPayload() { return data + Headroom; }
+			const unsigned char* GetPayload() const { return data + Headroom; }
+		};
+
+		PacketPool()
+		{
+			freeList = NULL;
+			allocated = 0;
+			available = 0;
+		}
+
+		~PacketPool()
+		{
+			for (size_t i = 0; i < blocks.size(); ++i)
+				delete[] blocks[i];
+		}
+
+		Buffer* Acquire()
+		{
+			if (!freeList)
+				Grow();
+			Buffer* buffer = freeList;
+			freeList = buffer->next;
+			buffer->next = NULL;
+			buffer->size = 0;
+			available--;
+			return buffer;
+		}
+
+		void Release(Buffer* buffer)
+		{
+			assert(buffer);
+			buffer->next = freeList;
+			freeList = buffer;
+			available++;
+		}
+
+		int GetAllocated() const
+		{
+			return allocated;
+		}
+
+		int GetAvailable() const
+		{
+			return available;
+		}
+
+	private:
+
+		PacketPool(const PacketPool&);
+		PacketPool& operator = (const PacketPool&);
+
+		void Grow()
+		{
+			Buffer* block = new Buffer[BlockSize];
+			blocks.push_back(block);
+			for (int i = 0; i < BlockSize; ++i)
+				Release(&block[i]);
+			allocated += BlockSize;
+		}
+
+		std::vector<Buffer*> blocks;
+		Buffer* freeList;
+		int allocated;
+		int available;
+	};
+
+	// a received packet as it sits in the receive buffer, after every layer has stripped its header
+	//  + points into the connection's receive batch, so it is only valid until the next receive on that connection
+	//  + header fields are filled in by the layers that have them and left at zero otherwise
+
+	struct PacketView
+	{
+		const unsigned char* data;		// payload
+		int size;						// payload size in bytes
+		unsigned int sequence;			// reliability header
+		unsigned int ack;
+		unsigned int ack_bits;
+
+		PacketView()
+		{
+			data = NULL;
+			size = 0;
+			sequence = 0;
+			ack = 0;
+			ack_bits = 0;
+		}
+	};
+
+	// spreads packets evenly at a rate in bytes per second
+	//  + every packet gets a departure slot one transmission time (size / rate) after the one before
+	//  + slots are kept in nanoseconds, so small packets at multi gigabit rates do not round down to nothing
+	//  + a sender that falls behind keeps up to Credit of catch up, enough to absorb a late wake up without a burst
+	//  + with a lookahead packets may be handed over that long before their slot, for sockets that hold them back
+	//    until their departure time themselves (see Socket::EnableTxTime)
+
+	class Pacer
+	{
+	public:
+
+		static const unsigned long long Credit = 1000000;		// nanoseconds
+
+		Pacer()
+		{
+			rate = 0.0;
+			lookahead = 0;
+			Reset();
+		}
+
+		void Reset()
+		{
+			next = 0;
+		}
+
+		// zero turns pacing off
+
+		void SetRate(double bytesPerSecond)
+		{
+			rate = bytesPerSecond > 0.0 ? bytesPerSecond : 0.0;
+		}
+
+		double GetRate() const
+		{
+			return rate;
+		}
+
+		bool IsPaced() const
+		{
+			return rate > 0.0;
+		}
+
+		void SetLookahead(unsigned long long nanoseconds)
+		{
+			lookahead = nanoseconds;
+		}
+
+		bool CanSend(unsigned long long now) const
+		{
+			return !IsPaced() || next <= now + lookahead;
+		}
+
+		// earliest time CanSend turns true, in nanoseconds
+
+		unsigned long long GetNextSendTime() const
+		{
+			if (!IsPaced())
 				return 0;
-			if (packet[0] != (unsigned char)(protocolId >> 24) ||
-				packet[1] != (unsigned char)((protocolId >> 16) & 0xFF) ||
-				packet[2] != (unsigned char)((protocolId >> 8) & 0xFF) ||
-				packet[3] != (unsigned char)(protocolId & 0xFF))
+			return next > lookahead ? next - lookahead : 0;
+		}
+
+		// takes the next slot for a packet and returns its departure time, or zero if unpaced
+
+		unsigned long long Schedule(int size, unsigned long long now)
+		{
+			if (!IsPaced())
 				return 0;
-			if (mode == Server && !IsConnected())
+			if (next + Credit < now)
+				next = now - Credit;
+			const unsigned long long departure = std::max(next, now);
+			next += (unsigned long long)(size * 1000000000.0 / rate);
+			return departure;
+		}
+
+	private:
+
+		double rate;					// bytes per second, zero if unpaced
+		unsigned long long lookahead;	// nanoseconds
+		unsigned long long next;		// departure slot of the next packet, nanoseconds
+	};
+
+	// reads datagrams from a socket a batch at a time and hands them out one at a time
+	//  + a datagram stays in place in the batch buffer until the next batch is read over it
+	//  + datagrams already read won't wake a SocketWaiter, so the owner must not sleep while any are pending
+
+	class DatagramReader
+	{
+	public:
+
+		enum { Stride = PacketSizeHack + 4 };		// the biggest packet with the protocol id in front
+
+		DatagramReader()
+		{
+			Clear();
+		}
+
+		void Clear()
+		{
+			count = 0;
+			index = 0;
+		}
+
+		bool HasPending() const
+		{
+			return index < count;
+		}
+
+		// the next datagram, reading another batch once this one is used up
+		//  + returns false if the socket had nothing left
+
+		bool Read(Socket& socket, Address& sender, const unsigned char*& packet, int& size)
+		{
+			if (index == count)
 			{
-				printf("server accepts connection from client %d.%d.%d.%d:%d\n",
-					sender.GetA(), sender.GetB(), sender.GetC(), sender.GetD(), sender.GetPort());
-				state = Connected;
-				address = sender;
-				OnConnect();
+				if (buffer.empty())
+				{
+					buffer.resize(Socket::MaxBatchSize * Stride);
+					for (int i = 0; i < Socket::MaxBatchSize; ++i)
+						packets[i] = &buffer[i * Stride];
+				}
+				count = socket.ReceiveBatch(senders, packets, Stride, sizes, Socket::MaxBatchSize);
+				index = 0;
+				if (count == 0)
+					return false;
 			}
-			if (sender == address)
+			sender = senders[index];
+			packet = packets[index];
+			size = sizes[index];
+			index++;
+			return true;
+		}
+
+		// reads until the socket has nothing left or the budget is used up, calling receive( sender, packet, size )
+		// for each datagram. receive returns true for datagrams that count against the budget
+		//  + a budget of zero packets or zero seconds means no limit
+		//  + returns the number of datagrams counted
+
+		template <typename Function> int Drain(Socket& socket, Function receive, int maxPackets, float maxSeconds)
+		{
+			const Timestamp start = GetTimestamp();
+			const Timestamp maxTime = SecondsToTimestamp(maxSeconds);
+			Address sender;
+			const unsigned char* packet;
+			int size;
+			int received = 0;
+			while (maxPackets == 0 || received < maxPackets)
+			{
+				if (!Read(socket, sender, packet, size))
+					break;
+				if (receive(sender, packet, size))
+					received++;
+				if (maxTime != 0 && GetTimestamp() - start >= maxTime)
+					break;
+			}
+			return received;
+		}
+
+	private:
+
+		DatagramReader(const DatagramReader&);
+		DatagramReader& operator = (const DatagramReader&);
+
+		std::vector<unsigned char> buffer;					// MaxBatchSize datagrams of Stride bytes
+		unsigned char* packets[Socket::MaxBatchSize];
+		int sizes[Socket::MaxBatchSize];
+		Address senders[Socket::MaxBatchSize];
+		int count;											// datagrams in the last batch read from the socket
+		int index;											// next datagram to hand out
+	};
+
+	// connection
+
+	class Connection
+	{
+	public:
+
+		enum Mode
+		{
+			None,
+			Client,
+			Server
+		};
+
+		typedef std::function<void(const unsigned char data[], int size)> PacketHandler;
+
+		Connection(unsigned int protocolId, float timeout)
+		{
+			this->protocolId = protocolId;
+			this->timeout = timeout;
+			mode = None;
+			running = false;
+			batchDepth = 0;
+			sendBatchCount = 0;
+			sendBatchTimed = false;
+			transport = &socket;
+			sendBuffer.resize(DatagramReader::Stride);
+			ClearData();
+		}
+
+		virtual ~Connection()
+		{
+			if (IsRunning())
+				Stop();
+		}
+
+		bool Start(int port)
+		{
+			assert(!running);
+			printf("start connection on port %d\n", port);
+			if (!socket.Open(port))
+				return false;
+			transport = &socket;
+			running = true;
+			OnStart();
+			return true;
+		}
+
+		// runs this connection over a socket owned by someone else (see ConnectionManager)
+		//  + the connection starts out connected to the peer that sent the first packet
+		//  + the owner reads the socket and passes this peer's datagrams in through ReceiveDatagram
+
+		void Attach(Socket& shared, const Address& peer)
+		{
+			assert(!running);
+			assert(shared.IsOpen());
+			transport = &shared;
+			running = true;
+			OnStart();
+			mode = Server;
+			state = Connected;
+			address = peer;
+			OnConnect();
+		}
+
+		bool IsAttached() const
+		{
+			return transport != &socket;
+		}
+
+		void Stop()
+		{
+			assert(running);
+			if (!IsAttached())
+				printf("stop connection\n");
+			bool connected = IsConnected();
+			ClearData();
+			sendBatchCount = 0;
+			sendBatchTimed = false;
+			pacer.Reset();
+			pacer.SetLookahead(0);
+			reader.Clear();
+			socket.Close();
+			transport = &socket;
+			running = false;
+			if (connected)
+				OnDisconnect();
+			OnStop();
+		}
+
+		bool IsRunning() const
+		{
+			return running;
+		}
+
+		void Listen()
+		{
+			printf("server listening for connection\n");
+			bool connected = IsConnected();
+			ClearData();
+			if (connected)
+				OnDisconnect();
+			mode = Server;
+			state = Listening;
+		}
+
+		void Connect(const Address& address)
+		{
+			printf("client connecting to %d.%d.%d.%d:%d\n",
+				address.GetA(), address.GetB(), address.GetC(), address.GetD(), address.GetPort());
+			bool connected = IsConnected();
+			ClearData();
+			if (connected)
+				OnDisconnect();
+			mode = Client;
+			state = Connecting;
+			this->address = address;
+		}
+
+		bool IsConnecting() const
+		{
+			return state == Connecting;
+		}
+
+		bool ConnectFailed() const
+		{
+			return state == ConnectFail;
+		}
+
+		bool IsConnected() const
+		{
+			return state == Connected;
+		}
+
+		bool IsListening() const
+		{
+			return state == Listening;
+		}
+
+		Mode GetMode() const
+		{
+			return mode;
+		}
+
+		const Address& GetAddress() const
+		{
+			return address;
+		}
+
+		virtual void Update(float deltaTime)
+		{
+			assert(running);
+			timeoutAccumulator += deltaTime;
+			if (timeoutAccumulator > timeout)
+			{
+				if (state == Connecting)
+				{
+					printf("connect timed out\n");
+					ClearData();
+					state = ConnectFail;
+					OnDisconnect();
+				}
+				else if (state == Connected)
+				{
+					printf("connection timed out\n");
+					ClearData();
+					if (state == Connecting)
+						state = ConnectFail;
+					OnDisconnect();
+				}
+			}
+		}
+
+		// earliest time Update has something to do, used to decide how long to sleep
+
+		virtual Timestamp GetNextDeadline(Timestamp now) const
+		{
+			if (reader.HasPending())
+				return now;
+			if (state != Connecting && state != Connected)
+				return NoDeadline;
+			const float remaining = timeout - timeoutAccumulator;
+			return remaining > 0.0f ? now + SecondsToTimestamp(remaining) : now;
+		}
+
+		const Socket& GetSocket() const
+		{
+			return socket;
+		}
+
+		bool EnableOffload()
+		{
+			assert(running);
+			return socket.EnableOffload();
+		}
+
+		// paced packets are handed to the kernel up to TxTimeLookahead early with their departure time
+		// and the kernel releases them on time, see Socket::EnableTxTime
+
+		bool EnableTxTime()
+		{
+			assert(running);
+			if (!socket.EnableTxTime())
+				return false;
+			pacer.SetLookahead(TxTimeLookahead);
+			return true;
+		}
+
+		// every datagram sent takes a slot from the pacer, which does nothing until it is given a rate
+
+		Pacer& GetPacer()
+		{
+			return pacer;
+		}
+
+		const Pacer& GetPacer() const
+		{
+			return pacer;
+		}
+
+		virtual bool SendPacket(const unsigned char data[], int size)
+		{
+			return SendPacketWithHeader(NULL, 0, data, size);
+		}
+
+		// sends a packet that already has GetHeaderSize() bytes of headroom reserved in front of it
+		//  + the protocol id is written into the headroom and the datagram goes to the socket as is, the payload is not copied
+		//  + while batching only the pointer is queued, so the memory must stay untouched until the batch is flushed
+
+		bool SendPacketInPlace(unsigned char packet[], int size)
+		{
+			assert(running);
+			assert(size <= PacketSizeHack);
+			if (address.GetAddress() == 0)
+				return false;
+			unsigned char* datagram = packet - 4;
+			WriteProtocolId(datagram);
+			return SendDatagram(datagram, size + 4);
+		}
+
+		// packets sent between begin and end are queued and sent together with Socket::SendBatch
+		//  + batches may nest, the queue is flushed when the outermost batch ends
+
+		void BeginSendBatch()
+		{
+			if (sendBatchBuffer.empty())
+				sendBatchBuffer.resize(Socket::MaxBatchSize * DatagramReader::Stride);
+			batchDepth++;
+		}
+
+		bool EndSendBatch()
+		{
+			assert(batchDepth > 0);
+			if (--batchDepth > 0)
+				return true;
+			return FlushSendBatch();
+		}
+
+		virtual int ReceivePacket(unsigned char data[], int size)
+		{
+			PacketView view;
+			if (!ReceivePacketView(view))
+				return 0;
+			const int bytes = std::min(view.size, size);
+			std::memcpy(data, view.data, bytes);
+			return bytes;
+		}
+
+		// receives the next packet without copying it, see PacketView for how long the view stays valid
+		//  + returns false if there was nothing to read, or the datagram was not a valid packet for this connection
+
+		bool ReceivePacketView(PacketView& view)
+		{
+			assert(running);
+			// the owner of a shared socket passes packets in
+			if (IsAttached())
+				return false;
+			Address sender;
+			const unsigned char* packet;
+			int bytes_read;
+			if (!reader.Read(socket, sender, packet, bytes_read))
+				return false;
+			return ReceiveDatagram(sender, packet, bytes_read, view);
+		}
+
+		// true if the datagram has a payload after the protocol id, and the protocol id matches
+
+		static bool HasProtocolId(const unsigned char packet[], int bytes_read, unsigned int protocolId)
+		{
+			return bytes_read > 4 &&
+				packet[0] == (unsigned char)(protocolId >> 24) &&
+				packet[1] == (unsigned char)((protocolId >> 16) & 0xFF) &&
+				packet[2] == (unsigned char)((protocolId >> 8) & 0xFF) &&
+				packet[3] == (unsigned char)(protocolId & 0xFF);
+		}
+
+		// checks the protocol id and connection state of a datagram, then lets ReadPayload strip the layers above
+		//  + the view points into packet, nothing is copied
+
+		bool ReceiveDatagram(const Address& sender, const unsigned char packet[], int bytes_read, PacketView& view)
+		{
+			assert(running);
+			if (!HasProtocolId(packet, bytes_read, protocolId))
+				return false;
+			if (mode == Server && !IsConnected())
+			{
+				printf("server accepts connection from client %d.%d.%d.%d:%d\n",
+					sender.GetA(), sender.GetB(), sender.GetC(), sender.GetD(), sender.GetPort());
+				state = Connected;
+				address = sender;
+				OnConnect();
+			}
+			if (sender == address)
+			{
+				if (mode == Client && state == Connecting)
+				{
+					printf("client completes connection with server\n");
+					state = Connected;
+					OnConnect();
+				}
+				timeoutAccumulator = 0.0f;
+				view = PacketView();
+				view.data = &packet[4];
+				view.size = bytes_read - 4;
+				return ReadPayload(view);
+			}
+			return false;
+		}
+
+		// receives until the socket has nothing left or the budget is used up, handing each payload to the handler
+		//  + a budget of zero packets or zero seconds means no limit
+		//  + the handler sees the payload in place in the receive buffer, so it must copy anything it keeps
+		//  + returns the number of payloads handled
+
+		int ReceivePackets(const PacketHandler& handler, int maxPackets = 0, float maxSeconds = 0.0f)
+		{
+			assert(running);
+			if (IsAttached())
+				return 0;
+			PacketView view;
+			return reader.Drain(socket, [&](const Address& sender, const unsigned char packet[], int bytes_read)
+			{
+				if (!ReceiveDatagram(sender, packet, bytes_read, view))
+					return false;
+				handler(view.data, view.size);
+				return true;
+			}, maxPackets, maxSeconds);
+		}
+
+		int GetHeaderSize() const
+		{
+			return 4;
+		}
+
+	protected:
+
+		// layers above override this to read their own header off the front of the view
+		//  + returns false to drop the packet
+
+		virtual bool ReadPayload(PacketView& view)
+		{
+			return view.size > 0;
+		}
+
+		// sends a header for the layer above followed by its payload, copying both once into the outgoing datagram
+
+		bool SendPacketWithHeader(const unsigned char header[], int headerSize, const unsigned char data[], int size)
+		{
+			assert(running);
+			assert(headerSize + size <= PacketSizeHack);
+			if (address.GetAddress() == 0)
+				return false;
+			const bool batching = batchDepth > 0;
+			if (batching && sendBatchCount == Socket::MaxBatchSize && !FlushSendBatch())
+				return false;
+			unsigned char* packet = batching ? &sendBatchBuffer[sendBatchCount * DatagramReader::Stride] : &sendBuffer[0];
+			WriteProtocolId(packet);
+			if (headerSize > 0)
+				std::memcpy(&packet[4], header, headerSize);
+			std::memcpy(&packet[4 + headerSize], data, size);
+			return SendDatagram(packet, 4 + headerSize + size);
+		}
+
+		virtual void OnStart() {}
+		virtual void OnStop() {}
+		virtual void OnConnect() {}
+		virtual void OnDisconnect() {}
+
+	private:
+
+		static const unsigned long long TxTimeLookahead = 1000000;		// nanoseconds
+
+		void WriteProtocolId(unsigned char packet[]) const
+		{
+			packet[0] = (unsigned char)(protocolId >> 24);
+			packet[1] = (unsigned char)((protocolId >> 16) & 0xFF);
+			packet[2] = (unsigned char)((protocolId >> 8) & 0xFF);
+			packet[3] = (unsigned char)((protocolId) & 0xFF);
+		}
+
+		// sends a complete datagram now, or queues it if a batch is open
+		//  + a socket that can hold datagrams back gets the paced departure time with it, otherwise the caller
+		//    has already waited for the pacer and the datagram goes straight out
+
+		bool SendDatagram(const unsigned char datagram[], int size)
+		{
+			unsigned long long departure = 0;
+			if (pacer.IsPaced())
+			{
+				const unsigned long long now = GetNanoseconds();
+				departure = pacer.Schedule(size, now);
+				if (!transport->IsTxTimeEnabled() || departure <= now)
+					departure = 0;
+			}
+			if (batchDepth == 0)
+				return transport->Send(address, datagram, size, departure);
+			if (sendBatchCount == Socket::MaxBatchSize && !FlushSendBatch())
+				return false;
+			sendBatchPackets[sendBatchCount] = datagram;
+			sendBatchSizes[sendBatchCount] = size;
+			sendBatchDepartures[sendBatchCount] = departure;
+			sendBatchTimed |= departure != 0;
+			sendBatchCount++;
+			return true;
+		}
+
+		bool FlushSendBatch()
+		{
+			const int count = sendBatchCount;
+			const bool timed = sendBatchTimed;
+			sendBatchCount = 0;
+			sendBatchTimed = false;
+			if (count == 0 || address.GetAddress() == 0)
+				return count == 0;
+			return transport->SendBatch(address, sendBatchPackets, sendBatchSizes, count, timed ? sendBatchDepartures : NULL) == count;
+		}
+
+		void ClearData()
+		{
+			state = Disconnected;
+			timeoutAccumulator = 0.0f;
+			address = Address();
+		}
+
+		enum State
+		{
+			Disconnected,
+			Listening,
+			Connecting,
+			ConnectFail,
+			Connected
+		};
+
+		unsigned int protocolId;
+		float timeout;
+
+		bool running;
+		Mode mode;
+		State state;
+		Socket socket;
+		float timeoutAccumulator;
+		Address address;
+		Socket* transport;		// socket packets go through: our own, or a shared one when attached
+
+		int batchDepth;											// queue sends until the outermost EndSendBatch
+		std::vector<unsigned char> sendBuffer;					// single packet send buffer
+		std::vector<unsigned char> sendBatchBuffer;				// MaxBatchSize packets of DatagramReader::Stride bytes
+		const unsigned char* sendBatchPackets[Socket::MaxBatchSize];
+		int sendBatchSizes[Socket::MaxBatchSize];
+		unsigned long long sendBatchDepartures[Socket::MaxBatchSize];
+		bool sendBatchTimed;									// some queued datagram has a departure time
+		int sendBatchCount;
+		Pacer pacer;
+
+		DatagramReader reader;									// receives from our own socket, unused when attached
+	};
+
+	// packet queue to store information about sent and received packets sorted in sequence order
+	//  + we define ordering using the "sequence_more_recent" function, this works provided there is a large gap when sequence wrap occurs
+
+	struct PacketData
+	{
+		unsigned int sequence;			// packet sequence number
+		Timestamp time;					// time packet was sent or received (depending on context)
+		int size;						// packet size in bytes
+	};
+
+	inline bool sequence_more_recent(unsigned int s1, unsigned int s2, unsigned int max_sequence)
+	{
+		auto half_max = max_sequence / 2;
+		return (
+			((s1 > s2) && (s1 - s2 <= half_max))
+			||
+			((s2 > s1) && (s2 - s1 > half_max))
+			);
+	}
+
+	// number of steps from older to newer, going forward through sequence wrap around
+
+	inline unsigned int sequence_distance(unsigned int newer, unsigned int older, unsigned int max_sequence)
+	{
+		return newer >= older ? newer - older : newer + (max_sequence - older) + 1;
+	}
+
+	inline unsigned int sequence_next(unsigned int sequence, unsigned int max_sequence)
+	{
+		return sequence == max_sequence ? 0 : sequence + 1;
+	}
+
+	inline unsigned int sequence_prev(unsigned int sequence, unsigned int max_sequence)
+	{
+		return sequence == 0 ? max_sequence : sequence - 1;
+	}
+
+	// fixed size ring of packet data indexed by sequence % capacity
+	//  + insert, lookup and erase are O(1), nothing is allocated after construction
+	//  + front and back are the oldest and most recent sequences currently stored
+	//  + entries further than capacity behind the most recent sequence are evicted from the front
+
+	class PacketQueue
+	{
+	public:
+
+		template <typename Queue, typename Value> class iterator_base
+		{
+		public:
+
+			iterator_base(Queue* queue, unsigned int sequence, int remaining)
+				: queue(queue), sequence(sequence), remaining(remaining) {}
+
+			Value& operator * () const { return queue->entries[queue->index(sequence)]; }
+			Value* operator -> () const { return &queue->entries[queue->index(sequence)]; }
+
+			iterator_base& operator ++ ()
+			{
+				if (--remaining > 0)
+				{
+					do
+						sequence = sequence_next(sequence, queue->max_sequence);
+					while (!queue->exists(sequence));
+				}
+				return *this;
+			}
+
+			iterator_base operator ++ (int)
+			{
+				iterator_base result = *this;
+				++(*this);
+				return result;
+			}
+
+			bool operator == (const iterator_base& other) const { return remaining == other.remaining; }
+			bool operator != (const iterator_base& other) const { return remaining != other.remaining; }
+
+		private:
+
+			Queue* queue;
+			unsigned int sequence;
+			int remaining;
+		};
+
+		typedef iterator_base<PacketQueue, PacketData> iterator;
+		typedef iterator_base<const PacketQueue, const PacketData> const_iterator;
+
+		PacketQueue(unsigned int max_sequence = 0xFFFFFFFF, int capacity = 1024)
+		{
+			assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+			this->max_sequence = max_sequence;
+			entries.resize(capacity);
+			used.resize(capacity);
+			clear();
+		}
+
+		void clear()
+		{
+			std::fill(used.begin(), used.end(), false);
+			front_sequence = 0;
+			back_sequence = 0;
+			count = 0;
+		}
+
+		bool empty() const { return count == 0; }
+		int size() const { return count; }
+		int capacity() const { return (int)entries.size(); }
+
+		PacketData& front() { assert(count); return entries[index(front_sequence)]; }
+		PacketData& back() { assert(count); return entries[index(back_sequence)]; }
+		const PacketData& front() const { assert(count); return entries[index(front_sequence)]; }
+		const PacketData& back() const { assert(count); return entries[index(back_sequence)]; }
+
+		iterator begin() { return iterator(this, front_sequence, count); }
+		iterator end() { return iterator(this, 0, 0); }
+		const_iterator begin() const { return const_iterator(this, front_sequence, count); }
+		const_iterator end() const { return const_iterator(this, 0, 0); }
+
+		bool exists(unsigned int sequence) const
+		{
+			const int i = index(sequence);
+			return used[i] && entries[i].sequence == sequence;
+		}
+
+		PacketData* find(unsigned int sequence)
+		{
+			return exists(sequence) ? &entries[index(sequence)] : NULL;
+		}
+
+		// true if sequence can be inserted without evicting anything
+
+		bool fits(unsigned int sequence) const
+		{
+			if (used[index(sequence)])
+				return false;
+			return count == 0 || !sequence_more_recent(sequence, back_sequence, max_sequence) ||
+				sequence_distance(sequence, front_sequence, max_sequence) < (unsigned int)capacity();
+		}
+
+		// inserts in sequence order. returns false if the packet is too old to be tracked any more
+
+		bool insert(const PacketData& p)
+		{
+			assert(p.sequence <= max_sequence);
+			assert(!exists(p.sequence));
+
+			if (count > 0 && !sequence_more_recent(p.sequence, back_sequence, max_sequence))
+			{
+				if (sequence_distance(back_sequence, p.sequence, max_sequence) >= (unsigned int)capacity())
+					return false;
+				const int i = index(p.sequence);
+				if (used[i])
+				{
+					// only possible when max_sequence + 1 is not a multiple of the capacity
+					if (sequence_more_recent(entries[i].sequence, p.sequence, max_sequence))
+						return false;
+					erase(entries[i].sequence);
+				}
+			}
+			else
+			{
+				while (count > 0 && !fits(p.sequence))
+					pop_front();
+			}
+
+			const int i = index(p.sequence);
+			entries[i] = p;
+			used[i] = true;
+
+			if (count == 0)
+			{
+				front_sequence = p.sequence;
+				back_sequence = p.sequence;
+			}
+			else if (sequence_more_recent(p.sequence, back_sequence, max_sequence))
+				back_sequence = p.sequence;
+			else if (sequence_more_recent(front_sequence, p.sequence, max_sequence))
+				front_sequence = p.sequence;
+			count++;
+			return true;
+		}
+
+		bool erase(unsigned int sequence)
+		{
+			if (!exists(sequence))
+				return false;
+			used[index(sequence)] = false;
+			count--;
+			if (count > 0)
+			{
+				if (sequence == front_sequence)
+				{
+					do
+						front_sequence = sequence_next(front_sequence, max_sequence);
+					while (!exists(front_sequence));
+				}
+				else if (sequence == back_sequence)
+				{
+					do
+						back_sequence = sequence_prev(back_sequence, max_sequence);
+					while (!exists(back_sequence));
+				}
+			}
+			return true;
+		}
+
+		void pop_front()
+		{
+			assert(count);
+			erase(front_sequence);
+		}
+
+		void verify_sorted() const
+		{
+			int found = 0;
+			const_iterator prev = end();
+			for (const_iterator itor = begin(); itor != end(); itor++)
+			{
+				assert(itor->sequence <= max_sequence);
+				assert(exists(itor->sequence));
+				if (prev != end())
+					assert(sequence_more_recent(itor->sequence, prev->sequence, max_sequence));
+				prev = itor;
+				found++;
+			}
+			assert(found == count);
+		}
+
+	private:
+
+		int index(unsigned int sequence) const
+		{
+			return (int)(sequence & (unsigned int)(entries.size() - 1));
+		}
+
+		unsigned int max_sequence;
+		unsigned int front_sequence;
+		unsigned int back_sequence;
+		int count;
+		std::vector<PacketData> entries;
+		std::vector<bool> used;
+	};
+
+	// maps sequence numbers to values in a ring indexed by sequence % capacity
+	//  + insert, find and remove are O(1) and allocation free
+	//  + if two live sequences ever land in the same slot the ring doubles, which only happens when
+	//    far more entries are live than the capacity it was created with
+
+	template <typename T> class SequenceBuffer
+	{
+	public:
+
+		SequenceBuffer(int capacity = 256)
+		{
+			assert(capacity > 0 && (capacity & (capacity - 1)) == 0);
+			count = 0;
+			entries.resize(capacity);
+		}
+
+		T* Find(unsigned int sequence)
+		{
+			Entry& entry = entries[Index(sequence)];
+			return entry.used && entry.sequence == sequence ? &entry.value : NULL;
+		}
+
+		void Insert(unsigned int sequence, const T& value)
+		{
+			assert(!Find(sequence));
+			while (entries[Index(sequence)].used)
+				Grow();
+			Entry& entry = entries[Index(sequence)];
+			entry.sequence = sequence;
+			entry.value = value;
+			entry.used = true;
+			count++;
+		}
+
+		bool Remove(unsigned int sequence, T* value = NULL)
+		{
+			Entry& entry = entries[Index(sequence)];
+			if (!entry.used || entry.sequence != sequence)
+				return false;
+			if (value)
+				*value = entry.value;
+			entry = Entry();
+			count--;
+			return true;
+		}
+
+		// calls function( sequence, value ) for every entry, then empties the buffer
+
+		template <typename Function> void Clear(Function function)
+		{
+			for (size_t i = 0; i < entries.size(); ++i)
+			{
+				if (entries[i].used)
+					function(entries[i].sequence, entries[i].value);
+				entries[i] = Entry();
+			}
+			count = 0;
+		}
+
+		int Size() const
+		{
+			return count;
+		}
+
+	private:
+
+		struct Entry
+		{
+			Entry() : sequence(0), used(false), value() {}
+			unsigned int sequence;
+			bool used;
+			T value;
+		};
+
+		size_t Index(unsigned int sequence) const
+		{
+			return sequence & (entries.size() - 1);
+		}
+
+		void Grow()
+		{
+			std::vector<Entry> old;
+			old.swap(entries);
+			size_t capacity = old.size() * 2;
+			while (true)
+			{
+				entries.assign(capacity, Entry());
+				bool collided = false;
+				for (size_t i = 0; i < old.size() && !collided; ++i)
+				{
+					if (!old[i].used)
+						continue;
+					Entry& entry = entries[Index(old[i].sequence)];
+					if (entry.used)
+						collided = true;
+					else
+						entry = old[i];
+				}
+				if (!collided)
+					return;
+				capacity *= 2;
+			}
+		}
+
+		std::vector<Entry> entries;
+		int count;
+	};
+
+	// packet and byte rates over a sliding time window
+	//  + the window is split into buckets, old buckets are subtracted from running totals as they expire
+	//  + adding a sample or reading the rate is O(1), advancing costs at most one step per bucket
+
+	class RateWindow
+	{
+	public:
+
+		enum { BucketCount = 10 };
+
+		RateWindow(float seconds = 1.0f)
+		{
+			Reset(seconds);
+		}
+
+		void Reset(float seconds)
+		{
+			assert(seconds > 0.0f);
+			this->seconds = seconds;
+			bucket_duration = SecondsToTimestamp(seconds) / BucketCount;
+			if (bucket_duration == 0)
+				bucket_duration = 1;
+			Clear();
+		}
+
+		void Clear()
+		{
+			for (int i = 0; i < BucketCount; ++i)
+				buckets[i] = Bucket();
+			current_bucket = 0;
+			bucket_start = 0;
+			total_packets = 0;
+			total_bytes = 0;
+		}
+
+		void Advance(Timestamp now)
+		{
+			if (bucket_start == 0)
+			{
+				bucket_start = now;
+				return;
+			}
+			if (now - bucket_start >= bucket_duration * BucketCount)
+			{
+				// idle for the whole window, everything has expired
+				Clear();
+				bucket_start = now;
+				return;
+			}
+			while (now >= bucket_start + bucket_duration)
+			{
+				current_bucket = (current_bucket + 1) % BucketCount;
+				total_packets -= buckets[current_bucket].packets;
+				total_bytes -= buckets[current_bucket].bytes;
+				buckets[current_bucket] = Bucket();
+				bucket_start += bucket_duration;
+			}
+		}
+
+		void Add(Timestamp now, int bytes)
+		{
+			Advance(now);
+			buckets[current_bucket].packets++;
+			buckets[current_bucket].bytes += bytes;
+			total_packets++;
+			total_bytes += bytes;
+		}
+
+		float GetSeconds() const
+		{
+			return seconds;
+		}
+
+		float GetPacketsPerSecond() const
+		{
+			return total_packets / seconds;
+		}
+
+		float GetBytesPerSecond() const
+		{
+			return total_bytes / seconds;
+		}
+
+	private:
+
+		struct Bucket
+		{
+			Bucket() : packets(0), bytes(0) {}
+			unsigned int packets;
+			unsigned long long bytes;
+		};
+
+		float seconds;
+		Timestamp bucket_duration;
+		Timestamp bucket_start;
+		int current_bucket;
+		unsigned int total_packets;
+		unsigned long long total_bytes;
+		Bucket buckets[BucketCount];
+	};
+
+	// round trip time estimator and retransmit timeout as described in rfc 6298
+	//  + srtt and rttvar are smoothed from each sample, rto = srtt + max(granularity, 4 * rttvar)
+	//  + until the first sample arrives the rto is one second
+	//  + each timeout doubles the rto (karn's backoff) until the next sample recomputes it
+	//  + the rto is always clamped to [minimum, maximum]
+
+	class RoundTripEstimator
+	{
+	public:
+
+		RoundTripEstimator(float minimum = 0.05f, float maximum = 60.0f)
+		{
+			SetBounds(minimum, maximum);
+			Reset();
+		}
+
+		void SetBounds(float minimum, float maximum)
+		{
+			assert(minimum > 0.0f);
+			assert(maximum >= minimum);
+			this->minimum = minimum;
+			this->maximum = maximum;
+			UpdateTimeout();
+		}
+
+		void Reset()
+		{
+			srtt = 0.0f;
+			rttvar = 0.0f;
+			latest = 0.0f;
+			samples = 0;
+			backoff = 1.0f;
+			UpdateTimeout();
+		}
+
+		void AddSample(float rtt)
+		{
+			assert(rtt >= 0.0f);
+			if (samples == 0)
+			{
+				srtt = rtt;
+				rttvar = rtt * 0.5f;
+			}
+			else
+			{
+				rttvar += (std::fabs(srtt - rtt) - rttvar) * 0.25f;
+				srtt += (rtt - srtt) * 0.125f;
+			}
+			latest = rtt;
+			samples++;
+			backoff = 1.0f;
+			UpdateTimeout();
+		}
+
+		void Backoff()
+		{
+			if (timeout < maximum)
+				backoff *= 2.0f;
+			UpdateTimeout();
+		}
+
+		float GetSmoothed() const
+		{
+			return srtt;
+		}
+
+		float GetVariance() const
+		{
+			return rttvar;
+		}
+
+		float GetLatest() const
+		{
+			return latest;
+		}
+
+		float GetTimeout() const
+		{
+			return timeout;
+		}
+
+		unsigned int GetSampleCount() const
+		{
+			return samples;
+		}
+
+	private:
+
+		void UpdateTimeout()
+		{
+			const float granularity = 0.001f;
+			const float base = samples ? srtt + std::max(granularity, 4.0f * rttvar) : 1.0f;
+			timeout = std::min(std::max(base * backoff, minimum), maximum);
+		}
+
+		float minimum;
+		float maximum;
+		float srtt;						// smoothed round trip time
+		float rttvar;					// round trip time variation
+		float latest;					// most recent sample
+		float backoff;					// rto multiplier, doubled on each timeout and reset by the next sample
+		float timeout;					// current retransmit timeout
+		unsigned int samples;
+	};
+
+	// congestion controller interface
+	//  + the reliability system reports every packet sent (with the bytes in flight after it), acked and lost,
+	//    and calls OnUpdate once per update with the smoothed round trip time in seconds
+	//  + the controller answers with a congestion window: how many bytes may be in flight at once
+	//  + controllers that want sends spread out also return a pacing rate in bytes per second (zero means unpaced)
+
+	class CongestionControl
+	{
+	public:
+
+		virtual ~CongestionControl() {}
+
+		virtual const char* GetName() const = 0;
+
+		virtual void Reset() = 0;
+
+		virtual void OnPacketSent(const PacketData&, int) {}
+		virtual void OnPacketAcked(const PacketData& packet, Timestamp now) = 0;
+		virtual void OnPacketLost(const PacketData& packet, Timestamp now) = 0;
+		virtual void OnUpdate(Timestamp, float) {}
+
+		virtual int GetCongestionWindow() const = 0;
+
+		virtual float GetPacingRate() const
+		{
+			return 0.0f;
+		}
+	};
+
+	// newreno congestion control (rfc 5681, rfc 6582) with the window counted in bytes
+	//  + slow start doubles the window every round trip until the first loss or ssthresh
+	//  + congestion avoidance then adds one packet per window of acked bytes
+	//  + a loss starts fast recovery: the window is cut once, and losses of packets sent before
+	//    recovery started are ignored, until a packet sent after that point is acked
+	//  + the window is paced out over the smoothed round trip at 1.25 times its size (twice in slow start, so the
+	//    pacer never holds back the doubling), rather than leaving in one burst whenever acks open it
+
+	class NewRenoCongestionControl : public CongestionControl
+	{
+	public:
+
+		enum
+		{
+			InitialWindow = 10,			// packets
+			MinimumWindow = 2			// packets
+		};
+
+		NewRenoCongestionControl(int packetSize = PacketSizeHack)
+		{
+			assert(packetSize > 0);
+			this->packetSize = packetSize;
+			NewRenoCongestionControl::Reset();
+		}
+
+		virtual const char* GetName() const override
+		{
+			return "newreno";
+		}
+
+		virtual void Reset() override
+		{
+			window = (double)InitialWindow * packetSize;
+			ssthresh = 1e18;
+			recoveryStart = 0;
+			inRecovery = false;
+			ackedBytes = 0.0;
+			srtt = 0.0f;
+		}
+
+		virtual void OnPacketAcked(const PacketData& packet, Timestamp now) override
+		{
+			if (inRecovery)
+			{
+				if (packet.time <= recoveryStart)
+					return;
+				inRecovery = false;
+			}
+			if (window < ssthresh)
+				window += packet.size;
+			else
+				IncreaseWindow(packet, now);
+		}
+
+		virtual void OnPacketLost(const PacketData& packet, Timestamp now) override
+		{
+			if (inRecovery && packet.time <= recoveryStart)
+				return;
+			inRecovery = true;
+			recoveryStart = now;
+			window = std::max(DecreaseWindow(now), (double)MinimumWindow * packetSize);
+			ssthresh = window;
+			ackedBytes = 0.0;
+		}
+
+		virtual void OnUpdate(Timestamp, float rtt) override
+		{
+			srtt = rtt;
+		}
+
+		virtual int GetCongestionWindow() const override
+		{
+			return (int)std::min(window, 2e9);
+		}
+
+		// unpaced until the first round trip sample
+
+		virtual float GetPacingRate() const override
+		{
+			if (srtt <= 0.0f)
+				return 0.0f;
+			const double gain = InSlowStart() ? 2.0 : 1.25;
+			return (float)(gain * window / srtt);
+		}
+
+		bool InSlowStart() const
+		{
+			return window < ssthresh;
+		}
+
+		bool InRecovery() const
+		{
+			return inRecovery;
+		}
+
+	protected:
+
+		// congestion avoidance growth for each acked packet
+
+		virtual void IncreaseWindow(const PacketData& packet, Timestamp)
+		{
+			ackedBytes += packet.size;
+			if (ackedBytes >= window)
+			{
+				ackedBytes -= window;
+				window += packetSize;
+			}
+		}
+
+		// window to continue with after a congestion event
+
+		virtual double DecreaseWindow(Timestamp)
+		{
+			return window * 0.5;
+		}
+
+		int packetSize;
+		double window;				// congestion window in bytes
+		double ssthresh;			// slow start threshold in bytes
+		double ackedBytes;			// bytes acked toward the next congestion avoidance increase
+		Timestamp recoveryStart;	// packets sent up to this time belong to the window that was already cut
+		bool inRecovery;
+		float srtt;					// smoothed rtt from the reliability system, seconds
+	};
+
+	// cubic congestion control (rfc 8312) on top of the newreno slow start and recovery
+	//  + after a loss the window grows along a cubic curve centred on the window where the loss happened,
+	//    so it comes back quickly, probes carefully around the old maximum, then accelerates past it
+	//  + the growth never falls behind what reno would reach over the same time (the tcp friendly region)
+
+	class CubicCongestionControl : public NewRenoCongestionControl
+	{
+	public:
+
+		CubicCongestionControl(int packetSize = PacketSizeHack)
+			: NewRenoCongestionControl(packetSize)
+		{
+			CubicCongestionControl::Reset();
+		}
+
+		virtual const char* GetName() const override
+		{
+			return "cubic";
+		}
+
+		virtual void Reset() override
+		{
+			NewRenoCongestionControl::Reset();
+			lastMaximum = 0.0;
+			epochStart = 0;
+			origin = 0.0;
+			k = 0.0;
+			renoWindow = 0.0;
+		}
+
+	protected:
+
+		virtual void IncreaseWindow(const PacketData& packet, Timestamp now) override
+		{
+			const double c = 0.4;
+			const double beta = 0.7;
+			const double packets = window / packetSize;
+			if (epochStart == 0)
+			{
+				epochStart = now;
+				if (packets < lastMaximum)
+				{
+					k = std::cbrt((lastMaximum - packets) / c);
+					origin = lastMaximum;
+				}
+				else
+				{
+					k = 0.0;
+					origin = packets;
+				}
+				renoWindow = packets;
+			}
+			const double t = TimestampToSeconds(now - epochStart) - k;
+			const double target = origin + c * t * t * t;
+			renoWindow += 3.0 * (1.0 - beta) / (1.0 + beta) * packet.size / window;
+			const double goal = std::max(target, renoWindow);
+			if (goal > packets)
+				window += (goal - packets) / packets * packet.size;
+		}
+
+		virtual double DecreaseWindow(Timestamp) override
+		{
+			const double beta = 0.7;
+			const double packets = window / packetSize;
+			// fast convergence: give up bandwidth faster when the maximum keeps shrinking
+			lastMaximum = packets < lastMaximum ? packets * (1.0 + beta) * 0.5 : packets;
+			epochStart = 0;
+			return window * beta;
+		}
+
+	private:
+
+		double lastMaximum;			// window in packets when the last loss happened
+		Timestamp epochStart;		// start of the current growth period, zero after a loss
+		double origin;				// window in packets the cubic curve is centred on
+		double k;					// seconds from the epoch start until the curve reaches origin
+		double renoWindow;			// window in packets reno would have reached since the epoch started
+	};
+
+	// bbr style model based congestion control
+	//  + bottleneck bandwidth is the windowed maximum delivery rate over the last ten round trips
+	//  + the minimum round trip time is the lowest sample seen in the last ten seconds
+	//  + packets are paced at gain * bandwidth, with a window of two bandwidth delay products
+	//  + startup doubles the rate every round until bandwidth stops growing, drain empties the queue that built up,
+	//    then probe bandwidth cycles the gain 1.25, 0.75, 1, 1, 1, 1, 1, 1 one min rtt per phase, and probe rtt
+	//    shrinks the window for 200ms whenever the min rtt has not been refreshed for ten seconds
+	//  + loss is not a signal here, so random loss on the path does not reduce the rate
+
+	class BbrCongestionControl : public CongestionControl
+	{
+	public:
+
+		enum
+		{
+			InitialWindow = 10,			// packets
+			MinimumWindow = 4,			// packets
+			BandwidthRounds = 10,		// round trips the bandwidth maximum is kept for
+			CycleLength = 8				// probe bandwidth gain phases
+		};
+
+		BbrCongestionControl(int packetSize = PacketSizeHack)
+			: sendStates(1024)
+		{
+			assert(packetSize > 0);
+			this->packetSize = packetSize;
+			BbrCongestionControl::Reset();
+		}
+
+		virtual const char* GetName() const override
+		{
+			return "bbr";
+		}
+
+		virtual void Reset() override
+		{
+			state = Startup;
+			sendStates.Clear([](unsigned int, const SendState&) {});
+			delivered = 0;
+			deliveredTime = 0;
+			firstSentTime = 0;
+			bytesInFlight = 0;
+			round = 0;
+			nextRoundDelivered = 0;
+			for (int i = 0; i < BandwidthRounds; ++i)
+				bandwidthSamples[i] = 0.0;
+			bandwidth = 0.0;
+			fullBandwidth = 0.0;
+			fullBandwidthRounds = 0;
+			minRtt = 0.0f;
+			minRttStamp = 0;
+			srtt = 0.0f;
+			cycleIndex = 0;
+			cycleStart = 0;
+			probeRttDone = 0;
+			pacingGain = HighGain;
+			windowGain = HighGain;
+		}
+
+		virtual void OnPacketSent(const PacketData& packet, int bytesInFlight) override
+		{
+			// nothing in flight means the delivery rate clock restarts from this send
+			if (this->bytesInFlight == 0)
+			{
+				firstSentTime = packet.time;
+				deliveredTime = packet.time;
+			}
+			this->bytesInFlight = bytesInFlight;
+			SendState sent;
+			sent.delivered = delivered;
+			sent.deliveredTime = deliveredTime;
+			sent.firstSentTime = firstSentTime;
+			if (sendStates.Find(packet.sequence))
+				sendStates.Remove(packet.sequence);
+			sendStates.Insert(packet.sequence, sent);
+		}
+
+		virtual void OnPacketAcked(const PacketData& packet, Timestamp now) override
+		{
+			bytesInFlight = std::max(0, bytesInFlight - packet.size);
+			delivered += packet.size;
+			deliveredTime = now;
+			SendState sent;
+			if (!sendStates.Remove(packet.sequence, &sent))
+				return;
+			firstSentTime = packet.time;
+
+			// a round trip ends when a packet sent after the previous round ended is acked
+			const bool roundStart = sent.delivered >= nextRoundDelivered;
+			if (roundStart)
+			{
+				nextRoundDelivered = delivered;
+				round++;
+				bandwidthSamples[round % BandwidthRounds] = 0.0;
+			}
+
+			// delivery rate over the longer of the send and ack intervals, so neither a burst of sends nor a burst of acks inflates it
+			const Timestamp sendInterval = packet.time - sent.firstSentTime;
+			const Timestamp ackInterval = now - sent.deliveredTime;
+			const Timestamp interval = std::max(sendInterval, ackInterval);
+			if (interval > 0)
+			{
+				const double rate = (double)(delivered - sent.delivered) / TimestampToSeconds(interval);
+				double& sample = bandwidthSamples[round % BandwidthRounds];
+				sample = std::max(sample, rate);
+				bandwidth = 0.0;
+				for (int i = 0; i < BandwidthRounds; ++i)
+					bandwidth = std::max(bandwidth, bandwidthSamples[i]);
+			}
+
+			// once the minimum is ten seconds old any sample replaces it, so it can rise when the path gets longer.
+			// probe rtt, which the expiry also starts, then lowers it again as the queue drains
+			const bool minRttExpired = minRttStamp != 0 && now - minRttStamp > SecondsToTimestamp(10.0f);
+			if (now > packet.time)
+			{
+				const float rtt = TimestampToSeconds(now - packet.time);
+				if (minRttStamp == 0 || rtt <= minRtt || minRttExpired)
+				{
+					minRtt = rtt;
+					minRttStamp = now;
+				}
+			}
+
+			UpdateState(now, roundStart, minRttExpired);
+		}
+
+		virtual void OnPacketLost(const PacketData& packet, Timestamp) override
+		{
+			bytesInFlight = std::max(0, bytesInFlight - packet.size);
+			sendStates.Remove(packet.sequence);
+		}
+
+		virtual void OnUpdate(Timestamp, float rtt) override
+		{
+			srtt = rtt;
+		}
+
+		virtual int GetCongestionWindow() const override
+		{
+			if (state == ProbeRtt)
+				return MinimumWindow * packetSize;
+			const double bdp = GetBandwidthDelayProduct();
+			if (bdp <= 0.0)
+				return InitialWindow * packetSize;
+			return (int)std::min(std::max(bdp * windowGain, (double)MinimumWindow * packetSize), 2e9);
+		}
+
+		virtual float GetPacingRate() const override
+		{
+			if (bandwidth > 0.0)
+				return (float)(bandwidth * pacingGain);
+			// no delivery rate yet: spread the initial window over a round trip
+			const float rtt = std::max(minRttStamp ? minRtt : srtt, 0.001f);
+			return (float)(pacingGain * InitialWindow * packetSize / rtt);
+		}
+
+		double GetBandwidth() const
+		{
+			return bandwidth;
+		}
+
+		float GetMinRtt() const
+		{
+			return minRtt;
+		}
+
+	private:
+
+		enum State
+		{
+			Startup,
+			Drain,
+			ProbeBandwidth,
+			ProbeRtt
+		};
+
+		struct SendState
+		{
+			unsigned long long delivered;		// bytes delivered when the packet was sent
+			Timestamp deliveredTime;			// time of the last delivery before the packet was sent
+			Timestamp firstSentTime;			// send time of the packet most recently acked when this one was sent
+		};
+
+		static constexpr double HighGain = 2.885;	// 2 / ln(2), doubles the delivery rate every round
+
+		double GetBandwidthDelayProduct() const
+		{
+			return minRttStamp ? bandwidth * minRtt : 0.0;
+		}
+
+		static double GetCycleGain(int index)
+		{
+			static const double gains[CycleLength] = { 1.25, 0.75, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0 };
+			return gains[index];
+		}
+
+		void UpdateState(Timestamp now, bool roundStart, bool minRttExpired)
+		{
+			if (state == Startup && roundStart)
+			{
+				// bandwidth is full once three rounds in a row fail to grow it by a quarter
+				if (bandwidth >= fullBandwidth * 1.25)
+				{
+					fullBandwidth = bandwidth;
+					fullBandwidthRounds = 0;
+				}
+				else if (++fullBandwidthRounds >= 3)
+				{
+					state = Drain;
+					pacingGain = 1.0 / HighGain;
+					windowGain = HighGain;
+				}
+			}
+
+			if (state == Drain && bytesInFlight <= GetBandwidthDelayProduct())
+				EnterProbeBandwidth(now);
+
+			if (state == ProbeBandwidth)
+			{
+				// the draining phase may end early once the queue from the probing phase is gone
+				bool advance = now - cycleStart > SecondsToTimestamp(minRtt);
+				if (pacingGain < 1.0 && bytesInFlight <= GetBandwidthDelayProduct())
+					advance = true;
+				if (advance)
+				{
+					cycleIndex = (cycleIndex + 1) % CycleLength;
+					cycleStart = now;
+					pacingGain = GetCycleGain(cycleIndex);
+				}
+			}
+
+			if (state != ProbeRtt && minRttExpired)
+			{
+				state = ProbeRtt;
+				pacingGain = 1.0;
+				probeRttDone = 0;
+			}
+
+			if (state == ProbeRtt)
+			{
+				if (probeRttDone == 0 && bytesInFlight <= MinimumWindow * packetSize)
+					probeRttDone = now + SecondsToTimestamp(0.2f);
+				else if (probeRttDone != 0 && now >= probeRttDone)
+				{
+					minRttStamp = now;
+					if (fullBandwidthRounds >= 3)
+						EnterProbeBandwidth(now);
+					else
+					{
+						state = Startup;
+						pacingGain = HighGain;
+						windowGain = HighGain;
+					}
+				}
+			}
+		}
+
+		// starts in a cruising phase so the first probe comes after a few round trips of measurements
+
+		void EnterProbeBandwidth(Timestamp now)
+		{
+			state = ProbeBandwidth;
+			windowGain = 2.0;
+			cycleIndex = 2;
+			cycleStart = now;
+			pacingGain = GetCycleGain(cycleIndex);
+		}
+
+		int packetSize;
+		State state;
+		SequenceBuffer<SendState> sendStates;	// delivery state at the time each packet in flight was sent
+		unsigned long long delivered;			// total bytes acked
+		Timestamp deliveredTime;				// time of the last ack
+		Timestamp firstSentTime;				// send time of the most recently acked packet
+		int bytesInFlight;
+
+		unsigned int round;						// round trips counted by acks
+		unsigned long long nextRoundDelivered;	// delivered count that ends the current round
+		double bandwidthSamples[BandwidthRounds];	// maximum delivery rate in each of the last rounds, bytes per second
+		double bandwidth;						// bottleneck bandwidth estimate, bytes per second
+		double fullBandwidth;					// bandwidth startup last saw grow by a quarter
+		int fullBandwidthRounds;				// rounds since then
+
+		float minRtt;							// seconds
+		Timestamp minRttStamp;					// when minRtt was last lowered or refreshed, zero before the first sample
+		float srtt;								// smoothed rtt from the reliability system, used before the first sample
+
+		int cycleIndex;
+		Timestamp cycleStart;
+		Timestamp probeRttDone;					// when the current probe rtt can finish, zero until the window has drained
+		double pacingGain;
+		double windowGain;
+	};
+
+	// ledbat scavenger congestion control (rfc 6817) for background transfers
+	//  + the base delay is the lowest round trip seen over the last ten minutes, anything above it is queuing
+	//  + the window grows while queuing delay is under the target and shrinks in proportion once it goes over,
+	//    so as soon as other traffic builds a queue this connection backs off and leaves the link to it
+	//  + delay is measured on the round trip rather than one way, as in ledbat++, since the header carries no
+	//    timestamps. reverse path queuing then also counts against us, which only makes this more polite
+	//  + a loss halves the window, at most once per round trip
+
+	class LedbatCongestionControl : public CongestionControl
+	{
+	public:
+
+		enum
+		{
+			InitialWindow = 2,			// packets
+			MinimumWindow = 2,			// packets
+			AllowedIncrease = 1,		// packets the window may grow past what is actually in flight
+			BaseHistory = 10,			// minutes of base delay history
+			CurrentFilter = 4			// samples the current delay is the minimum of
+		};
+
+		LedbatCongestionControl(int packetSize = PacketSizeHack, float target = 0.025f)
+		{
+			assert(packetSize > 0);
+			assert(target > 0.0f);
+			this->packetSize = packetSize;
+			this->target = target;
+			LedbatCongestionControl::Reset();
+		}
+
+		virtual const char* GetName() const override
+		{
+			return "ledbat";
+		}
+
+		virtual void Reset() override
+		{
+			window = (double)InitialWindow * packetSize;
+			bytesInFlight = 0;
+			lastReduction = 0;
+			for (int i = 0; i < BaseHistory; ++i)
+				baseDelays[i] = -1.0f;
+			baseMinute = 0;
+			baseIndex = 0;
+			for (int i = 0; i < CurrentFilter; ++i)
+				currentDelays[i] = -1.0f;
+			currentIndex = 0;
+			queuingDelay = 0.0f;
+		}
+
+		virtual void OnPacketSent(const PacketData&, int bytesInFlight) override
+		{
+			this->bytesInFlight = bytesInFlight;
+		}
+
+		virtual void OnPacketAcked(const PacketData& packet, Timestamp now) override
+		{
+			bytesInFlight = std::max(0, bytesInFlight - packet.size);
+			if (now < packet.time)
+				return;
+			AddDelaySample(TimestampToSeconds(now - packet.time), now);
+			const double offTarget = (target - queuingDelay) / target;
+			window += offTarget * packet.size * packetSize / window;
+			// never grow much past what the sender is actually using
+			const double ceiling = (double)std::max(bytesInFlight + packet.size, 0) + AllowedIncrease * packetSize;
+			window = std::min(window, std::max(ceiling, (double)InitialWindow * packetSize));
+			window = std::max(window, (double)MinimumWindow * packetSize);
+		}
+
+		virtual void OnPacketLost(const PacketData& packet, Timestamp now) override
+		{
+			bytesInFlight = std::max(0, bytesInFlight - packet.size);
+			if (packet.time <= lastReduction)
+				return;
+			lastReduction = now;
+			window = std::max(window * 0.5, (double)MinimumWindow * packetSize);
+		}
+
+		virtual int GetCongestionWindow() const override
+		{
+			return (int)window;
+		}
+
+		float GetQueuingDelay() const
+		{
+			return queuingDelay;
+		}
+
+		float GetTarget() const
+		{
+			return target;
+		}
+
+	private:
+
+		void AddDelaySample(float delay, Timestamp now)
+		{
+			// base delay: one minimum per minute, kept for the last BaseHistory minutes
+			const Timestamp minute = now / SecondsToTimestamp(60.0f);
+			if (baseMinute == 0)
+				baseMinute = minute;
+			else if (minute != baseMinute)
+			{
+				baseMinute = minute;
+				baseIndex = (baseIndex + 1) % BaseHistory;
+				baseDelays[baseIndex] = -1.0f;
+			}
+			if (baseDelays[baseIndex] < 0.0f || delay < baseDelays[baseIndex])
+				baseDelays[baseIndex] = delay;
+
+			currentDelays[currentIndex] = delay;
+			currentIndex = (currentIndex + 1) % CurrentFilter;
+
+			float base = delay;
+			for (int i = 0; i < BaseHistory; ++i)
+			{
+				if (baseDelays[i] >= 0.0f)
+					base = std::min(base, baseDelays[i]);
+			}
+			float current = delay;
+			for (int i = 0; i < CurrentFilter; ++i)
+			{
+				if (currentDelays[i] >= 0.0f)
+					current = std::min(current, currentDelays[i]);
+			}
+			queuingDelay = current - base;
+		}
+
+		int packetSize;
+		float target;						// queuing delay to aim for, seconds
+		double window;						// congestion window in bytes
+		int bytesInFlight;
+		Timestamp lastReduction;			// when the window was last halved for a loss
+		float baseDelays[BaseHistory];		// minimum delay in each of the last minutes, negative if none
+		Timestamp baseMinute;				// minute number the current base delay slot belongs to
+		int baseIndex;
+		float currentDelays[CurrentFilter];	// most recent delay samples, negative if none
+		int currentIndex;
+		float queuingDelay;					// current delay above the base delay, seconds
+	};
+
+	// run of consecutive received sequences carried by an ack, beginning with the oldest
+
+	struct AckRange
+	{
+		unsigned int first;
+		unsigned int count;
+	};
+
+	// reliability system to support reliable connection		
+	//  + manages sent, received, pending ack and acked packet queues
+	//  + separated out from reliable connection because it is quite complex and i want to unit test it!
+
+	class ReliabilitySystem
+	{
+	public:
+
+		enum StatsWindow
+		{
+			ShortWindow,
+			LongWindow,
+			StatsWindowCount
+		};
+
+		enum
+		{
+			AckBits = 32,					// ack bits in the standard header
+			MaxAckBits = 256,				// widest ack mask supported
+			MaxAckWords = MaxAckBits / 32,
+			MaxAckRanges = 4,				// most ranges of received packets an ack carries beyond its mask
+			AckHistory = 1024,				// received packets are tracked this far back, for the mask and the ranges
+			PacketThreshold = 3,			// a pending packet this far behind the newest acked one is lost
+			MaxTailProbes = 2				// probes sent without an ack in between before the rto takes over
+		};
+
+		ReliabilitySystem(unsigned int max_sequence = 0xFFFFFFFF)
+			: sentQueue(max_sequence), pendingAckQueue(max_sequence), receivedQueue(max_sequence, 2 * AckHistory), ackedQueue(max_sequence)
+		{
+			SetStatsWindow(ShortWindow, 1.0f);
+			SetStatsWindow(LongWindow, 10.0f);
+			this->max_sequence = max_sequence;
+			current_time = GetTimestamp();
+			congestion = NULL;
+			Reset();
+		}
+
+		void Reset()
+		{
+			local_sequence = 0;
+			remote_sequence = 0;
+			sentQueue.clear();
+			receivedQueue.clear();
+			pendingAckQueue.clear();
+			ackedQueue.clear();
+			evicted.clear();
+			sent_packets = 0;
+			recv_packets = 0;
+			lost_packets = 0;
+			acked_packets = 0;
+			sent_bandwidth = 0.0f;
+			acked_bandwidth = 0.0f;
+			for (int i = 0; i < StatsWindowCount; ++i)
+			{
+				sentRate[i].Clear();
+				ackedRate[i].Clear();
+			}
+			roundTrip.Reset();
+			bytes_in_flight = 0;
+			largest_acked = 0;
+			has_largest_acked = false;
+			tail_probes = 0;
+			probe_due = false;
+			if (congestion)
+				congestion->Reset();
+		}
+
+		// the congestion controller is told about every packet sent, acked and lost. it is not owned
+
+		void SetCongestionControl(CongestionControl* congestion)
+		{
+			this->congestion = congestion;
+			if (congestion)
+				congestion->Reset();
+		}
+
+		CongestionControl* GetCongestionControl() const
+		{
+			return congestion;
+		}
+
+		void PacketSent(int size)
+		{
+			PacketSent(size, current_time);
+		}
+
+		void PacketSent(int size, Timestamp time)
+		{
+			if (sentQueue.exists(local_sequence))
+			{
+				printf("local sequence %d exists\n", local_sequence);
+				for (PacketQueue::iterator itor = sentQueue.begin(); itor != sentQueue.end(); ++itor)
+					printf(" + %d\n", itor->sequence);
+			}
+			assert(!sentQueue.exists(local_sequence));
+			assert(!pendingAckQueue.exists(local_sequence));
+			PacketData data;
+			data.sequence = local_sequence;
+			data.time = time;
+			data.size = size;
+			sentQueue.insert(data);
+			// a packet pushed out of the pending ring can never be acked, so it counts as lost. this happens between
+			// updates, so it is reported by the next one rather than added to a lost list that is already being read
+			while (!pendingAckQueue.fits(local_sequence))
+				PacketLost(pendingAckQueue.front(), time, evicted);
+			pendingAckQueue.insert(data);
+			bytes_in_flight += size;
+			if (congestion)
+				congestion->OnPacketSent(data, bytes_in_flight);
+			for (int i = 0; i < StatsWindowCount; ++i)
+				sentRate[i].Add(time, size);
+			sent_packets++;
+			local_sequence++;
+			if (local_sequence > max_sequence)
+				local_sequence = 0;
+		}
+
+		void PacketReceived(unsigned int sequence, int size)
+		{
+			PacketReceived(sequence, size, current_time);
+		}
+
+		void PacketReceived(unsigned int sequence, int size, Timestamp time)
+		{
+			recv_packets++;
+			if (receivedQueue.exists(sequence))
+				return;
+			PacketData data;
+			data.sequence = sequence;
+			data.time = time;
+			data.size = size;
+			receivedQueue.insert(data);
+			// the first packet sets where the remote sequence starts, wherever the peer happens to be
+			if (recv_packets == 1 || sequence_more_recent(sequence, remote_sequence, max_sequence))
+				remote_sequence = sequence;
+		}
+
+		unsigned int GenerateAckBits()
+		{
+			return generate_ack_bits(GetRemoteSequence(), receivedQueue, max_sequence);
+		}
+
+		// ack mask of words * 32 bits, word 0 is the mask GenerateAckBits returns and each following word continues further back
+
+		void GenerateAckBits(unsigned int ack_bits[], int words)
+		{
+			generate_ack_bits(GetRemoteSequence(), receivedQueue, max_sequence, ack_bits, words);
+		}
+
+		void ProcessAck(unsigned int ack, unsigned int ack_bits)
+		{
+			ProcessAck(ack, ack_bits, current_time);
+		}
+
+		void ProcessAck(unsigned int ack, unsigned int ack_bits, Timestamp time)
+		{
+			ProcessAck(ack, &ack_bits, 1, time);
+		}
+
+		// runs of received packets older than the first skip packets behind the remote sequence, newest run first.
+		// these are the packets an ack mask of skip bits cannot cover. returns the number of ranges written
+
+		int GenerateAckRanges(AckRange ranges[], int max_ranges, int skip) const
+		{
+			return generate_ack_ranges(GetRemoteSequence(), receivedQueue, max_sequence, skip, ranges, max_ranges);
+		}
+
+		void ProcessAck(unsigned int ack, const unsigned int ack_bits[], int words, Timestamp time)
+		{
+			ProcessAck(ack, ack_bits, words, NULL, 0, time);
+		}
+
+		// an ack mask plus the ranges that came with it, all acked together
+
+		void ProcessAck(unsigned int ack, const unsigned int ack_bits[], int words, const AckRange ranges[], int range_count, Timestamp time)
+		{
+			const size_t first_ack = acks.size();
+			process_ack(ack, ack_bits, words, pendingAckQueue, ackedQueue, acks, acked_packets, roundTrip, time, max_sequence);
+			process_ack_ranges(ranges, range_count, pendingAckQueue, ackedQueue, acks, acked_packets, roundTrip, time, max_sequence);
+			if (acks.size() > first_ack)
+				tail_probes = 0;
+			for (size_t i = first_ack; i < acks.size(); ++i)
+			{
+				if (!has_largest_acked || sequence_more_recent(acks[i], largest_acked, max_sequence))
+				{
+					largest_acked = acks[i];
+					has_largest_acked = true;
+				}
+				const PacketData* packet = ackedQueue.find(acks[i]);
+				for (int j = 0; j < StatsWindowCount; ++j)
+					ackedRate[j].Add(time, packet ? packet->size : 0);
+				if (!packet)
+					continue;
+				bytes_in_flight -= packet->size;
+				if (congestion)
+					congestion->OnPacketAcked(*packet, time);
+			}
+		}
+
+		// packet ages are measured against the time passed in here, nothing is touched per packet
+
+		void Update(Timestamp now)
+		{
+			acks.clear();
+			lost.swap(evicted);
+			evicted.clear();
+			probe_due = false;
+			current_time = now;
+			UpdateQueues();
+			UpdateStats();
+			if (congestion)
+				congestion->OnUpdate(now, roundTrip.GetSmoothed());
+#ifdef NET_UNIT_TEST
+			Validate();
+#endif
+		}
+
+		void Validate()
+		{
+			sentQueue.verify_sorted();
+			receivedQueue.verify_sorted();
+			pendingAckQueue.verify_sorted();
+			ackedQueue.verify_sorted();
+		}
+
+		// utility functions
+
+	/*
+		static bool sequence_more_recent( unsigned int s1, unsigned int s2, unsigned int max_sequence )
+		{
+			return ( s1 > s2 ) && ( s1 - s2 <= max_sequence/2 ) || ( s2 > s1 ) && ( s2 - s1 > max_sequence/2 );
+		}
+	*/
+
+		static int bit_index_for_sequence(unsigned int sequence, unsigned int ack, unsigned int max_sequence)
+		{
+			assert(sequence != ack);
+			assert(!sequence_more_recent(sequence, ack, max_sequence));
+			if (sequence > ack)
+			{
+				assert(ack < MaxAckBits + 1);
+				assert(max_sequence >= sequence);
+				return ack + (max_sequence - sequence);
+			}
+			else
+			{
+				assert(ack >= 1);
+				assert(sequence <= ack - 1);
+				return ack - 1 - sequence;
+			}
+		}
+
+		static unsigned int sequence_for_bit_index(int bit_index, unsigned int ack, unsigned int max_sequence)
+		{
+			assert(bit_index >= 0 && bit_index < MaxAckBits);
+			if (ack >= (unsigned int)bit_index + 1)
+				return ack - 1 - bit_index;
+			else
+				return max_sequence - (bit_index - ack);
+		}
+
+		static unsigned int generate_ack_bits(unsigned int ack, const PacketQueue& received_queue, unsigned int max_sequence)
+		{
+			unsigned int ack_bits = 0;
+			for (int bit_index = 0; bit_index <= 31; ++bit_index)
+			{
+				if (received_queue.exists(sequence_for_bit_index(bit_index, ack, max_sequence)))
+					ack_bits |= 1u << bit_index;
+			}
+			return ack_bits;
+		}
+
+		static void generate_ack_bits(unsigned int ack, const PacketQueue& received_queue, unsigned int max_sequence,
+			unsigned int ack_bits[], int words)
+		{
+			assert(words >= 1 && words <= MaxAckWords);
+			ack_bits[0] = generate_ack_bits(ack, received_queue, max_sequence);
+			for (int word = 1; word < words; ++word)
+			{
+				ack_bits[word] = 0;
+				for (int bit = 0; bit < 32; ++bit)
+				{
+					if (received_queue.exists(sequence_for_bit_index(word * 32 + bit, ack, max_sequence)))
+						ack_bits[word] |= 1u << bit;
+				}
+			}
+		}
+
+		static int generate_ack_ranges(unsigned int ack, const PacketQueue& received_queue, unsigned int max_sequence, int skip,
+			AckRange ranges[], int max_ranges)
+		{
+			assert(skip >= 0 && skip < AckHistory);
+			if (received_queue.empty())
+				return 0;
+			const unsigned int oldest = received_queue.front().sequence;
+			unsigned int sequence = ack >= (unsigned int)skip + 1 ? ack - 1 - skip : max_sequence - (skip - ack);
+			int count = 0;
+			for (int distance = skip + 1; distance <= AckHistory; ++distance, sequence = sequence_prev(sequence, max_sequence))
+			{
+				if (sequence_more_recent(oldest, sequence, max_sequence))
+					break;
+				if (!received_queue.exists(sequence))
+					continue;
+				if (count > 0 && ranges[count - 1].first == sequence_next(sequence, max_sequence))
+				{
+					ranges[count - 1].first = sequence;
+					ranges[count - 1].count++;
+					continue;
+				}
+				if (count == max_ranges)
+					break;
+				ranges[count].first = sequence;
+				ranges[count].count = 1;
+				count++;
+			}
+			return count;
+		}
+
+		static void process_ack(unsigned int ack, unsigned int ack_bits,
+			PacketQueue& pending_ack_queue, PacketQueue& acked_queue,
+			std::vector<unsigned int>& acks, unsigned int& acked_packets,
+			RoundTripEstimator& round_trip, Timestamp time, unsigned int max_sequence)
+		{
+			process_ack(ack, &ack_bits, 1, pending_ack_queue, acked_queue, acks, acked_packets, round_trip, time, max_sequence);
+		}
+
+		static void process_ack(unsigned int ack, const unsigned int ack_bits[], int words,
+			PacketQueue& pending_ack_queue, PacketQueue& acked_queue,
+			std::vector<unsigned int>& acks, unsigned int& acked_packets,
+			RoundTripEstimator& round_trip, Timestamp time, unsigned int max_sequence)
+		{
+			assert(words >= 1 && words <= MaxAckWords);
+			if (pending_ack_queue.empty())
+				return;
+
+			process_ack_sequence(ack, pending_ack_queue, acked_queue, acks, acked_packets, round_trip, time);
+			for (int word = 0; word < words; ++word)
+			{
+				unsigned int bits = ack_bits[word];
+				for (int bit = 0; bits != 0; ++bit, bits >>= 1)
+				{
+					if (bits & 1)
+						process_ack_sequence(sequence_for_bit_index(word * 32 + bit, ack, max_sequence),
+							pending_ack_queue, acked_queue, acks, acked_packets, round_trip, time);
+				}
+			}
+		}
+
+		// a range can't cover more than the pending queue holds, which bounds the work a bogus range can cause
+
+		static void process_ack_ranges(const AckRange ranges[], int range_count,
+			PacketQueue& pending_ack_queue, PacketQueue& acked_queue,
+			std::vector<unsigned int>& acks, unsigned int& acked_packets,
+			RoundTripEstimator& round_trip, Timestamp time, unsigned int max_sequence)
+		{
+			for (int i = 0; i < range_count && !pending_ack_queue.empty(); ++i)
+			{
+				const unsigned int count = std::min(ranges[i].count, (unsigned int)pending_ack_queue.capacity());
+				unsigned int sequence = ranges[i].first;
+				for (unsigned int j = 0; j < count; ++j, sequence = sequence_next(sequence, max_sequence))
+					process_ack_sequence(sequence, pending_ack_queue, acked_queue, acks, acked_packets, round_trip, time);
+			}
+		}
+
+		// every send, including a resend, uses a fresh sequence number, so an ack always identifies the
+		// transmission it measures and each one gives a valid rtt sample (karn's ambiguity cannot arise)
+
+		static void process_ack_sequence(unsigned int sequence,
+			PacketQueue& pending_ack_queue, PacketQueue& acked_queue,
+			std::vector<unsigned int>& acks, unsigned int& acked_packets, RoundTripEstimator& round_trip, Timestamp time)
+		{
+			const PacketData* packet = pending_ack_queue.find(sequence);
+			if (!packet)
+				return;
+
+			round_trip.AddSample(time > packet->time ? TimestampToSeconds(time - packet->time) : 0.0f);
+
+			acked_queue.insert(*packet);
+			acks.push_back(sequence);
+			acked_packets++;
+			pending_ack_queue.erase(sequence);
+		}
+
+		// time the oldest pending packet will be declared lost
+
+		Timestamp GetNextDeadline() const
+		{
+			if (pendingAckQueue.empty())
+				return NoDeadline;
+			const PacketData& front = pendingAckQueue.front();
+			const Timestamp timeout = front.time + SecondsToTimestamp(roundTrip.GetTimeout() + 0.001f) + 1;
+			const Timestamp deadline = std::min(timeout, GetProbeDeadline());
+			if (has_largest_acked && sequence_more_recent(largest_acked, front.sequence, max_sequence))
+				return std::min(deadline, front.time + SecondsToTimestamp(GetLossDelay()));
+			return deadline;
+		}
+
+		// most recent sequence the peer has acked, false if it has acked nothing yet
+
+		bool GetLargestAcked(unsigned int& sequence) const
+		{
+			sequence = largest_acked;
+			return has_largest_acked;
+		}
+
+		// true if the last update found a tail loss probe due, the owner then sends one
+
+		bool IsProbeDue() const
+		{
+			return probe_due;
+		}
+
+		// data accessors
+
+		unsigned int GetLocalSequence() const
+		{
+			return local_sequence;
+		}
+
+		unsigned int GetRemoteSequence() const
+		{
+			return remote_sequence;
+		}
+
+		unsigned int GetMaxSequence() const
+		{
+			return max_sequence;
+		}
+
+		void GetAcks(unsigned int** acks, int& count)
+		{
+			*acks = this->acks.data();
+			count = (int)this->acks.size();
+		}
+
+		void GetLost(unsigned int** lost, int& count)
+		{
+			*lost = this->lost.data();
+			count = (int)this->lost.size();
+		}
+
+		unsigned int GetSentPackets() const
+		{
+			return sent_packets;
+		}
+
+		unsigned int GetReceivedPackets() const
+		{
+			return recv_packets;
+		}
+
+		unsigned int GetLostPackets() const
+		{
+			return lost_packets;
+		}
+
+		unsigned int GetAckedPackets() const
+		{
+			return acked_packets;
+		}
+
+		float GetSentBandwidth() const
+		{
+			return sent_bandwidth;
+		}
+
+		// the short and long windows default to 1 and 10 seconds
+
+		void SetStatsWindow(StatsWindow window, float seconds)
+		{
+			assert(window >= 0 && window < StatsWindowCount);
+			sentRate[window].Reset(seconds);
+			ackedRate[window].Reset(seconds);
+		}
+
+		float GetSentPacketsPerSecond(StatsWindow window = ShortWindow) const
+		{
+			return sentRate[window].GetPacketsPerSecond();
+		}
+
+		float GetSentBytesPerSecond(StatsWindow window = ShortWindow) const
+		{
+			return sentRate[window].GetBytesPerSecond();
+		}
+
+		float GetAckedPacketsPerSecond(StatsWindow window = ShortWindow) const
+		{
+			return ackedRate[window].GetPacketsPerSecond();
+		}
+
+		float GetAckedBytesPerSecond(StatsWindow window = ShortWindow) const
+		{
+			return ackedRate[window].GetBytesPerSecond();
+		}
+
+		float GetAckedBandwidth() const
+		{
+			return acked_bandwidth;
+		}
+
+		float GetRoundTripTime() const
+		{
+			return roundTrip.GetSmoothed();
+		}
+
+		int GetBytesInFlight() const
+		{
+			return bytes_in_flight;
+		}
+
+		float GetRoundTripTimeVariance() const
+		{
+			return roundTrip.GetVariance();
+		}
+
+		float GetRetransmitTimeout() const
+		{
+			return roundTrip.GetTimeout();
+		}
+
+		// the retransmit timeout defaults to [50 ms, 60 s]
+
+		void SetRetransmitTimeoutBounds(float minimum, float maximum)
+		{
+			roundTrip.SetBounds(minimum, maximum);
+		}
+
+		int GetHeaderSize() const
+		{
+			return 12;
+		}
+
+	protected:
+
+		float GetAge(const PacketData& packet) const
+		{
+			return current_time > packet.time ? TimestampToSeconds(current_time - packet.time) : 0.0f;
+		}
+
+		void UpdateQueues()
+		{
+			const float epsilon = 0.001f;
+			const float rto = roundTrip.GetTimeout();
+
+			while (sentQueue.size() && GetAge(sentQueue.front()) > rto + epsilon)
+				sentQueue.pop_front();
+
+			if (receivedQueue.size())
+			{
+				const unsigned int latest_sequence = receivedQueue.back().sequence;
+				const unsigned int window = AckHistory + 2;
+				const unsigned int minimum_sequence = latest_sequence >= window ? (latest_sequence - window) : max_sequence - (window - latest_sequence);
+				while (receivedQueue.size() && !sequence_more_recent(receivedQueue.front().sequence, minimum_sequence, max_sequence))
+					receivedQueue.pop_front();
+			}
+
+			while (ackedQueue.size() && GetAge(ackedQueue.front()) > rto * 2 - epsilon)
+				ackedQueue.pop_front();
+
+			// packets sent before one that has been acked are lost once PacketThreshold newer ones were sent, or once
+			// they are a loss delay older than now, well before the rto. the pending queue is in sequence order, so
+			// only its front ever needs checking
+			if (has_largest_acked)
+			{
+				const Timestamp loss_delay = SecondsToTimestamp(GetLossDelay());
+				while (pendingAckQueue.size() && sequence_more_recent(largest_acked, pendingAckQueue.front().sequence, max_sequence))
+				{
+					const PacketData& front = pendingAckQueue.front();
+					if (sequence_distance(largest_acked, front.sequence, max_sequence) < PacketThreshold && current_time < front.time + loss_delay)
+						break;
+					PacketLost(front, current_time, lost);
+				}
+			}
+
+			bool timed_out = false;
+			while (pendingAckQueue.size() && GetAge(pendingAckQueue.front()) > rto + epsilon)
+			{
+				PacketLost(pendingAckQueue.front(), current_time, lost);
+				timed_out = true;
+			}
+			if (timed_out)
+			{
+				roundTrip.Backoff();
+				tail_probes = 0;
+			}
+
+			if (current_time >= GetProbeDeadline())
+			{
+				probe_due = true;
+				tail_probes++;
+			}
+		}
+
+		// a tail loss probe is due once nothing has been acked for a probe timeout after the newest send. the
+		// packets at the tail have nothing sent after them whose ack would reveal their loss, so without a probe
+		// they would wait for the rto
+
+		Timestamp GetProbeDeadline() const
+		{
+			if (pendingAckQueue.empty() || roundTrip.GetSampleCount() == 0 || tail_probes >= MaxTailProbes)
+				return NoDeadline;
+			return pendingAckQueue.back().time + SecondsToTimestamp(GetProbeTimeout());
+		}
+
+		float GetProbeTimeout() const
+		{
+			const float minimum = 0.01f;
+			return std::max(2.0f * roundTrip.GetSmoothed(), minimum);
+		}
+
+		// how long a packet may go unacked after a later one was acked before it counts as lost: 9/8 of the round
+		// trip, allowing a little reordering and jitter
+
+		float GetLossDelay() const
+		{
+			const float granularity = 0.001f;
+			return std::max(std::max(roundTrip.GetSmoothed(), roundTrip.GetLatest()) * 9.0f / 8.0f, granularity);
+		}
+
+		// the packet must be the front of the pending ack queue
+
+		void PacketLost(const PacketData& packet, Timestamp now, std::vector<unsigned int>& lost_list)
+		{
+			const PacketData data = packet;
+			lost_list.push_back(data.sequence);
+			pendingAckQueue.pop_front();
+			lost_packets++;
+			bytes_in_flight -= data.size;
+			if (congestion)
+				congestion->OnPacketLost(data, now);
+		}
+
+		void UpdateStats()
+		{
+			for (int i = 0; i < StatsWindowCount; ++i)
+			{
+				sentRate[i].Advance(current_time);
+				ackedRate[i].Advance(current_time);
+			}
+			sent_bandwidth = sentRate[ShortWindow].GetBytesPerSecond() * (8 / 1000.0f);
+			acked_bandwidth = ackedRate[ShortWindow].GetBytesPerSecond() * (8 / 1000.0f);
+		}
+
+	private:
+
+		unsigned int max_sequence;			// maximum sequence value before wrap around (used to test sequence wrap at low # values)
+		unsigned int local_sequence;		// local sequence number for most recently sent packet
+		unsigned int remote_sequence;		// remote sequence number for most recently received packet
+
+		unsigned int sent_packets;			// total number of packets sent
+		unsigned int recv_packets;			// total number of packets received
+		unsigned int lost_packets;			// total number of packets lost
+		unsigned int acked_packets;			// total number of packets acked
+
+		float sent_bandwidth;				// approximate sent bandwidth in kbps over the short stats window
+		float acked_bandwidth;				// approximate acked bandwidth in kbps over the short stats window
+		RoundTripEstimator roundTrip;		// smoothed round trip time and the retransmit timeout derived from it
+		int bytes_in_flight;				// bytes sent and neither acked nor declared lost
+		unsigned int largest_acked;			// most recent sequence acked so far, packets sent before it may be lost early
+		bool has_largest_acked;
+		int tail_probes;					// probes sent since the last ack or timeout
+		bool probe_due;						// the last update wants a tail loss probe sent
+		CongestionControl* congestion;		// optional congestion controller fed with send, ack and loss events
+		Timestamp current_time;				// time passed to the last update, packet ages are measured against it
+
+		RateWindow sentRate[StatsWindowCount];		// packets and bytes sent over each stats window
+		RateWindow ackedRate[StatsWindowCount];		// packets and bytes acked over each stats window
+
+		std::vector<unsigned int> acks;		// acked packets from last set of packet receives. cleared each update!
+		std::vector<unsigned int> lost;		// packets declared lost by the last update. cleared each update!
+		std::vector<unsigned int> evicted;	// packets pushed out of the pending ring since the last update, lost by the next
+
+		PacketQueue sentQueue;				// sent packets, used to catch sequence reuse (kept until the rto)
+		PacketQueue pendingAckQueue;		// sent packets which have not been acked yet (lost after the rto, or when the ring is full)
+		PacketQueue receivedQueue;			// received packets for determining acks to send (kept up to most recent recv sequence - AckHistory)
+		PacketQueue ackedQueue;				// acked packets (kept until twice the rto)
+	};
+
+	// connection with reliability (seq/ack)
+	//  + the standard header is [sequence][ack][ack bits], 32 bits each. sequences are 31 bits, so its first bit is clear
+	//  + a compact header (SetCompactHeader) starts with a byte of CompactFlags instead, its top bit set. then come
+	//    the low 1 to 4 bytes of the sequence, the ack as one byte back from the sequence or as 4 bytes, and the ack
+	//    bits unless they are all ones or all zero. the receiver rebuilds the sequence from the one it expects next
+	//  + connections may be set up to use a wider ack mask (SetAckBits) or ack ranges (SetAckRanges). these always
+	//    go out in a compact header, followed by a byte of ExtensionFlags: the width of the mask in this header and
+	//    the widest mask we accept, both as 32 << n, and whether we take ack ranges and some follow. then comes the
+	//    rest of the mask beyond the first 32 bits and, if flagged, a count byte and that many ranges of received
+	//    packets older than the mask, each as [distance back from ack][length], 16 bits each
+	//  + each side acks with the narrower of the two widths and only sends ranges if both take them
+	//  + an ack packet carries a header and nothing else. it has no sequence of its own, so it is never acked or
+	//    resent: a standard header with no payload (its sequence is ignored), or a compact one flagged ack only
+	//  + either side may send either header, every connection reads both
+
+	class ReliableConnection : public Connection
+	{
+	public:
+
+		enum
+		{
+			StandardHeaderSize = 12,
+			CompactHeaderSize = 13,			// largest compact header without the extension
+			MaxHeaderSize = CompactHeaderSize + 1 + (ReliabilitySystem::MaxAckWords - 1) * 4 + 1 + ReliabilitySystem::MaxAckRanges * 4
+		};
+
+		ReliableConnection(unsigned int protocolId, float timeout, unsigned int max_sequence = 0x7FFFFFFF)
+			: Connection(protocolId, timeout), reliabilitySystem(max_sequence)
+		{
+			// the first bit of the standard header tells it from a compact one
+			assert(max_sequence <= 0x7FFFFFFF);
+			ackBits = ReliabilitySystem::AckBits;
+			ackRanges = false;
+			compactHeader = false;
+			ackFrequency = 0;
+			ackDelay = 0.0f;
+			ClearData();
+#ifdef NET_UNIT_TEST
+			packet_loss_mask = 0;
+#endif
+		}
+
+		~ReliableConnection()
+		{
+			if (IsRunning())
+				Stop();
+		}
+
+		// overriden functions from "Connection"
+
+		virtual bool SendPacket(const unsigned char data[], int dataSize) override
+		{
+			if (DropPacket())
+				return true;
+			unsigned char header[MaxHeaderSize];
+			const int headerSize = WritePacketHeader(header);
+			if (!SendPacketWithHeader(header, headerSize, data, dataSize))
+				return false;
+			PacketSent(dataSize);
+			return true;
+		}
+
+		// send a packet that is held in the retransmit buffer until acked, and resent if lost
+		//  + the payload is copied into a pooled buffer, use AcquireBuffer to build it there in the first place
+
+		bool SendReliablePacket(const unsigned char data[], int dataSize)
+		{
+			PacketPool::Buffer* buffer = pool.Acquire();
+			std::memcpy(buffer->GetPayload(), data, dataSize);
+			buffer->size = dataSize;
+			return SendReliableBuffer(buffer);
+		}
+
+		// a pooled buffer to write a reliable payload into at GetPayload(), with its size, for SendReliableBuffer
+		//  + the headroom in front of the payload is left for the headers, so the payload is never copied again
+
+		PacketPool::Buffer* AcquireBuffer()
+		{
+			return pool.Acquire();
+		}
+
+		// returns a buffer from AcquireBuffer that is not going to be sent after all
+
+		void ReleaseBuffer(PacketPool::Buffer* buffer)
+		{
+			pool.Release(buffer);
+		}
+
+		// sends a payload built in a buffer from AcquireBuffer, see SendReliablePacket
+		//  + the connection takes the buffer whether or not the send succeeds
+
+		bool SendReliableBuffer(PacketPool::Buffer* buffer)
+		{
+			if (SendBuffer(buffer))
+				return true;
+			pool.Release(buffer);
+			return false;
+		}
+
+		void Update(float deltaTime)
+		{
+			Connection::Update(deltaTime);
+			ReleaseAckedPackets();
+			reliabilitySystem.Update(GetTimestamp());
+			UpdatePacingRate();
+			ResendLostPackets();
+			if (reliabilitySystem.IsProbeDue())
+				SendTailProbe();
+			if (receivedUnacked > 0 && GetTimestamp() >= ackDeadline)
+				SendAck();
+		}
+
+		virtual Timestamp GetNextDeadline(Timestamp now) const override
+		{
+			const Timestamp deadline = std::min(Connection::GetNextDeadline(now), reliabilitySystem.GetNextDeadline());
+			return receivedUnacked > 0 ? std::min(deadline, ackDeadline) : deadline;
+		}
+
+		// acks normally ride on whatever we send next, so a connection that mostly receives would hardly ack at all.
+		// with this set, acks also go out in packets of their own: once every packets received, at most delay
+		// seconds after the oldest packet not acked yet, and straight away when a packet arrives out of order.
+		// anything sent in between carries the acks and starts the count again. zero packets turns this off
+
+		void SetAckDelay(int packets, float delay)
+		{
+			assert(packets >= 0);
+			assert(delay >= 0.0f);
+			ackFrequency = packets;
+			ackDelay = delay;
+		}
+
+		// sends our acks in a packet of their own, see the notes above the class
+
+		bool SendAck()
+		{
+			unsigned char header[MaxHeaderSize];
+			const int headerSize = WritePacketHeader(header, true);
+			if (!SendPacketWithHeader(NULL, 0, header, headerSize))
+				return false;
+			AcksSent();
+			ack_packets++;
+			return true;
+		}
+
+		// the congestion controller decides how much may be in flight, see CanSendPacket. it is not owned
+
+		void SetCongestionControl(CongestionControl* congestion)
+		{
+			reliabilitySystem.SetCongestionControl(congestion);
+			UpdatePacingRate();
+		}
+
+		// true if a packet of this size fits in the congestion window and the pacing rate allows it now
+		//  + always true without a controller
+		//  + resends of lost packets are not gated, the loss already took them out of flight
+
+		bool CanSendPacket(int size) const
+		{
+			const CongestionControl* congestion = reliabilitySystem.GetCongestionControl();
+			if (!congestion)
+				return true;
+			if (!GetPacer().CanSend(GetNanoseconds()))
+				return false;
+			return WindowHasRoom(*congestion, size);
+		}
+
+		// earliest time CanSendPacket can become true without an ack arriving, or NoDeadline if the window is full
+
+		Timestamp GetNextSendTime(int size) const
+		{
+			const CongestionControl* congestion = reliabilitySystem.GetCongestionControl();
+			if (!congestion)
+				return 0;
+			if (!WindowHasRoom(*congestion, size))
+				return NoDeadline;
+			// rounded up, waking early would only find the pacer still closed
+			return (GetPacer().GetNextSendTime() + 999) / 1000;
+		}
+
+		// number of reliable packets sent but not acked yet
+
+		int GetPendingReliablePackets() const
+		{
+			return retransmitBuffer.Size();
+		}
+
+		unsigned int GetResentPackets() const
+		{
+			return resent_packets;
+		}
+
+		unsigned int GetProbePackets() const
+		{
+			return probe_packets;
+		}
+
+		unsigned int GetAckPackets() const
+		{
+			return ack_packets;
+		}
+
+		// the largest header this connection may put in front of a payload
+
+		int GetHeaderSize() const
+		{
+			return Connection::GetHeaderSize() + GetReliabilityHeaderSize(ackBits);
+		}
+
+		// widest ack mask to use, 32, 64, 128 or up to ReliabilitySystem::MaxAckBits
+		//  + the peer learns it from our headers, and both sides use the narrower of their two widths
+
+		void SetAckBits(int bits)
+		{
+			assert(GetWidthCode(bits) >= 0);
+			ackBits = bits;
+		}
+
+		// width of the ack mask currently sent, as agreed with the peer
+
+		int GetAckBits() const
+		{
+			return std::min(ackBits, peerAckBits);
+		}
+
+		// selective acks: ranges of received packets beyond the ack mask, so the holes left by a burst of loss
+		// can be told apart from packets that arrived. only used once the peer says it takes them too
+
+		void SetAckRanges(bool enabled)
+		{
+			ackRanges = enabled;
+		}
+
+		bool HasAckRanges() const
+		{
+			return ackRanges && peerAckRanges;
+		}
+
+		// send compact headers, see the notes above the class. the peer reads them whatever it sends itself
+
+		void SetCompactHeader(bool enabled)
+		{
+			compactHeader = enabled;
+		}
+
+		// how many packets may be in flight and still be described by the acks we get back
+		//  + the mask covers its width whatever the loss. ranges reach further only while the holes are few, so
+		//    they are counted on for one more mask width rather than the whole ack history
+
+		int GetAckWindow() const
+		{
+			return HasAckRanges() ? 2 * GetAckBits() : GetAckBits();
+		}
+
+		ReliabilitySystem& GetReliabilitySystem()
+		{
+			return reliabilitySystem;
+		}
+
+		// unit test controls
+
+#ifdef NET_UNIT_TEST
+		void SetPacketLossMask(unsigned int mask)
+		{
+			packet_loss_mask = mask;
+		}
+#endif
+
+	protected:
+
+		virtual bool ReadPayload(PacketView& view) override
+		{
+			if (view.size <= 0)
+				return false;
+			unsigned int ack_bits[ReliabilitySystem::MaxAckWords];
+			int words = 1;
+			AckRange ranges[ReliabilitySystem::MaxAckRanges];
+			int range_count = 0;
+			int header = StandardHeaderSize;
+			bool ackOnly;
+			if (view.data[0] & CompactHeader)
+			{
+				// a sequence cut short is rebuilt against those received before. with none received, the peer is still
+				// on a session we no longer have: drop it, and owe an ack now so the peer goes back to full sequences
+				if (!(view.data[0] & CompactAckOnly) && (view.data[0] & CompactSequenceBytes) != CompactSequenceBytes &&
+					reliabilitySystem.GetReceivedPackets() == 0)
+				{
+					receivedUnacked = 1;
+					ackDeadline = GetTimestamp();
+					return false;
+				}
+				header = ReadCompactHeader(view, ack_bits, words, ranges, range_count);
+				if (header == 0)
+					return false;
+				ackOnly = (view.data[0] & CompactAckOnly) != 0;
+			}
+			else
+			{
+				if (view.size < header)
+					return false;
+				ReadHeader(view.data, view.sequence, view.ack, view.ack_bits); // Extract header information
+				ack_bits[0] = view.ack_bits;
+				ackOnly = view.size == header;
+			}
+			view.data += header;
+			view.size -= header;
+			// the latest word, not the newest: a peer that started over says so by acking something older
+			peerAck = view.ack;
+			hasPeerAck = true;
+			const Timestamp now = GetTimestamp();
+			if (ackOnly)
+			{
+				// nothing for the caller, and nothing to ack in return
+				reliabilitySystem.ProcessAck(view.ack, ack_bits, words, ranges, range_count, now);
+				return false;
+			}
+			// Notify reliability system about the received packet
+			const bool inOrder = view.sequence == sequence_next(reliabilitySystem.GetRemoteSequence(), reliabilitySystem.GetMaxSequence());
+			reliabilitySystem.PacketReceived(view.sequence, view.size, now);
+			reliabilitySystem.ProcessAck(view.ack, ack_bits, words, ranges, range_count, now);
+			AckPending(inOrder, now);
+			return true;
+		}
+
+		// delayed ack bookkeeping for a packet just received, see SetAckDelay
+
+		void AckPending(bool inOrder, Timestamp now)
+		{
+			if (ackFrequency == 0)
+				return;
+			if (receivedUnacked++ == 0)
+				ackDeadline = now + SecondsToTimestamp(ackDelay);
+			if (receivedUnacked >= ackFrequency || !inOrder)
+				SendAck();
+		}
+
+		void AcksSent()
+		{
+			receivedUnacked = 0;
+			ackDeadline = NoDeadline;
+		}
+
+		// reads a compact header and its extension into the view and the arrays. returns its size, or zero if the
+		// packet is too short to hold it and, unless it is an ack on its own, at least one byte of payload
+
+		int ReadCompactHeader(PacketView& view, unsigned int ack_bits[], int& words, AckRange ranges[], int& range_count)
+		{
+			const unsigned char flags = view.data[0];
+			// a payload must follow the header, unless this is an ack on its own
+			const int tail = (flags & CompactAckOnly) ? 0 : 1;
+			int header = 1;
+			if (!(flags & CompactAckOnly))
+			{
+				const int sequenceBytes = (flags & CompactSequenceBytes) + 1;
+				if (view.size < header + sequenceBytes + tail)
+					return 0;
+				view.sequence = ReadSequence(view.data + header, sequenceBytes);
+				header += sequenceBytes;
+			}
+			if (flags & CompactAckDelta)
+			{
+				if (flags & CompactAckOnly || view.size < header + 1 + tail)
+					return 0;
+				const unsigned int delta = view.data[header++];
+				const unsigned int max_sequence = reliabilitySystem.GetMaxSequence();
+				view.ack = view.sequence >= delta ? view.sequence - delta : max_sequence - (delta - view.sequence - 1);
+			}
+			else
+			{
+				if (view.size < header + 4 + tail)
+					return 0;
+				ReadInteger(view.data + header, view.ack);
+				header += 4;
+			}
+			if (flags & CompactAckBitsOnes)
+				view.ack_bits = 0xFFFFFFFF;
+			else if (flags & CompactAckBitsZero)
+				view.ack_bits = 0;
+			else
+			{
+				if (view.size < header + 4 + tail)
+					return 0;
+				ReadInteger(view.data + header, view.ack_bits);
+				header += 4;
+			}
+			ack_bits[0] = view.ack_bits;
+			if (!(flags & CompactExtension))
+				return header;
+
+			if (view.size < header + 1 + tail)
+				return 0;
+			const unsigned char extension = view.data[header++];
+			words = GetWidthBits(extension & ExtensionWidth) / 32;
+			if (view.size < header + (words - 1) * 4 + tail)
+				return 0;
+			for (int i = 1; i < words; ++i, header += 4)
+				ReadInteger(view.data + header, ack_bits[i]);
+			if (extension & ExtensionRangesFollow)
+			{
+				if (view.size < header + 1 + tail)
+					return 0;
+				range_count = view.data[header++];
+				if (range_count > ReliabilitySystem::MaxAckRanges || view.size < header + range_count * 4 + tail)
+					return 0;
+				for (int i = 0; i < range_count; ++i, header += 4)
+					ReadRange(view.data + header, view.ack, ranges[i]);
+			}
+			peerAckBits = GetWidthBits((extension & ExtensionWidest) >> ExtensionWidestShift);
+			peerAckRanges = (extension & ExtensionRanges) != 0;
+			return header;
+		}
+
+		void WriteInteger(unsigned char* data, unsigned int value)
+		{
+			data[0] = (unsigned char)(value >> 24);
+			data[1] = (unsigned char)((value >> 16) & 0xFF);
+			data[2] = (unsigned char)((value >> 8) & 0xFF);
+			data[3] = (unsigned char)(value & 0xFF);
+		}
+
+		void WriteHeader(unsigned char* header, unsigned int sequence, unsigned int ack, unsigned int ack_bits)
+		{
+			WriteInteger(header, sequence);
+			WriteInteger(header + 4, ack);
+			WriteInteger(header + 8, ack_bits);
+		}
+
+		// header for the next packet sent: our sequence, plus acks for what we have received. returns its size
+		//  + an ack on its own leaves the sequence out of a compact header, a standard one ignores it
+
+		int WritePacketHeader(unsigned char* header, bool ackOnly = false)
+		{
+			const unsigned int sequence = reliabilitySystem.GetLocalSequence();
+			const unsigned int ack = reliabilitySystem.GetRemoteSequence();
+			if (!compactHeader && !IsExtended())
+			{
+				WriteHeader(header, sequence, ack, reliabilitySystem.GenerateAckBits());
+				return StandardHeaderSize;
+			}
+			const int width = IsExtended() ? GetAckBits() : ReliabilitySystem::AckBits;
+			const int words = width / 32;
+			unsigned int ack_bits[ReliabilitySystem::MaxAckWords];
+			reliabilitySystem.GenerateAckBits(ack_bits, words);
+
+			unsigned char flags = CompactHeader;
+			int size = 1;
+			if (ackOnly)
+				flags |= CompactAckOnly;
+			else
+			{
+				const int sequenceBytes = GetSequenceBytes(sequence);
+				flags |= (unsigned char)(sequenceBytes - 1);
+				for (int i = sequenceBytes - 1; i >= 0; --i)
+					header[size++] = (unsigned char)((sequence >> (i * 8)) & 0xFF);
+			}
+			const unsigned int max_sequence = reliabilitySystem.GetMaxSequence();
+			if (!ackOnly && !sequence_more_recent(ack, sequence, max_sequence) && sequence_distance(sequence, ack, max_sequence) <= 0xFF)
+			{
+				flags |= CompactAckDelta;
+				header[size++] = (unsigned char)sequence_distance(sequence, ack, max_sequence);
+			}
+			else
+			{
+				WriteInteger(header + size, ack);
+				size += 4;
+			}
+			if (ack_bits[0] == 0xFFFFFFFF)
+				flags |= CompactAckBitsOnes;
+			else if (ack_bits[0] == 0)
+				flags |= CompactAckBitsZero;
+			else
+			{
+				WriteInteger(header + size, ack_bits[0]);
+				size += 4;
+			}
+			if (!IsExtended())
+			{
+				header[0] = flags;
+				return size;
+			}
+
+			flags |= CompactExtension;
+			header[0] = flags;
+			AckRange ranges[ReliabilitySystem::MaxAckRanges];
+			const int range_count = HasAckRanges() ? reliabilitySystem.GenerateAckRanges(ranges, ReliabilitySystem::MaxAckRanges, width) : 0;
+			header[size++] = (unsigned char)(GetWidthCode(width) | (GetWidthCode(ackBits) << ExtensionWidestShift) |
+				(ackRanges ? ExtensionRanges : 0) | (range_count > 0 ? ExtensionRangesFollow : 0));
+			for (int i = 1; i < words; ++i, size += 4)
+				WriteInteger(header + size, ack_bits[i]);
+			if (range_count > 0)
+			{
+				header[size++] = (unsigned char)range_count;
+				for (int i = 0; i < range_count; ++i, size += 4)
+					WriteRange(header + size, ack, ranges[i]);
+			}
+			return size;
+		}
+
+		// fewest bytes of the sequence the peer can rebuild it from. it rebuilds against the sequence after the
+		// newest it has received, which is what its last packet acked, so twice our distance from that must fit
+		//  + all 4 bytes go until the peer has acked something, so a new session always starts from full sequences
+		//  + a peer that lost its state (a session that ended and was accepted again, say) acks something we never
+		//    sent, or something older than what it acked before. full sequences go out again until it has caught up,
+		//    and it drops those cut short until then, see ReadPayload
+		//  + only sequence spaces of a power of two can be cut short, others always send all 4 bytes
+
+		int GetSequenceBytes(unsigned int sequence) const
+		{
+			const unsigned int max_sequence = reliabilitySystem.GetMaxSequence();
+			unsigned int acked;
+			if (((max_sequence + 1) & max_sequence) != 0 || !hasPeerAck || !reliabilitySystem.GetLargestAcked(acked))
+				return 4;
+			if (sequence_more_recent(acked, peerAck, max_sequence) || !sequence_more_recent(sequence, peerAck, max_sequence))
+				return 4;
+			const unsigned int unacked = sequence_distance(sequence, peerAck, max_sequence);
+			for (int bytes = 1; bytes < 4; ++bytes)
+			{
+				if (unacked < (1u << (bytes * 8 - 1)))
+					return bytes;
+			}
+			return 4;
+		}
+
+		// the candidate ending in these bytes nearest the sequence we expect next, see GetSequenceBytes
+
+		unsigned int ReadSequence(const unsigned char* data, int bytes) const
+		{
+			unsigned int value = 0;
+			for (int i = 0; i < bytes; ++i)
+				value = (value << 8) | data[i];
+			if (bytes == 4)
+				return value;
+			const unsigned int max_sequence = reliabilitySystem.GetMaxSequence();
+			const unsigned int expected = sequence_next(reliabilitySystem.GetRemoteSequence(), max_sequence);
+			const unsigned int window = 1u << (bytes * 8);
+			unsigned int sequence = ((expected & ~(window - 1)) | value) & max_sequence;
+			const unsigned int ahead = sequence_distance(sequence, expected, max_sequence);
+			if (ahead <= max_sequence / 2)
+			{
+				if (ahead > window / 2)
+					sequence = (sequence - window) & max_sequence;
+			}
+			else if (max_sequence - ahead + 1 >= window / 2)
+				sequence = (sequence + window) & max_sequence;
+			return sequence;
+		}
+
+		// ranges go on the wire relative to the ack they come with, see generate_ack_ranges for how far back they reach
+
+		void WriteRange(unsigned char* data, unsigned int ack, const AckRange& range)
+		{
+			const unsigned int max_sequence = reliabilitySystem.GetMaxSequence();
+			const unsigned int last = range.first <= max_sequence - (range.count - 1) ?
+				range.first + range.count - 1 : range.count - 2 - (max_sequence - range.first);
+			const unsigned int distance = sequence_distance(ack, last, max_sequence);
+			assert(distance <= 0xFFFF && range.count <= 0xFFFF);
+			data[0] = (unsigned char)(distance >> 8);
+			data[1] = (unsigned char)(distance & 0xFF);
+			data[2] = (unsigned char)(range.count >> 8);
+			data[3] = (unsigned char)(range.count & 0xFF);
+		}
+
+		void ReadRange(const unsigned char* data, unsigned int ack, AckRange& range)
+		{
+			const unsigned int max_sequence = reliabilitySystem.GetMaxSequence();
+			const unsigned int distance = ((unsigned int)data[0] << 8) | data[1];
+			range.count = ((unsigned int)data[2] << 8) | data[3];
+			// first = ack - distance - (count - 1), wrapping through max_sequence
+			unsigned int back = distance + (range.count > 0 ? range.count - 1 : 0);
+			range.first = ack >= back ? ack - back : max_sequence - (back - ack - 1);
+		}
+
+		void ReadInteger(const unsigned char* data, unsigned int& value)
+		{
+			value = (((unsigned int)data[0] << 24) | ((unsigned int)data[1] << 16) |
+				((unsigned int)data[2] << 8) | ((unsigned int)data[3]));
+		}
+
+		void ReadHeader(const unsigned char* header, unsigned int& sequence, unsigned int& ack, unsigned int& ack_bits)
+		{
+			ReadInteger(header, sequence);
+			ReadInteger(header + 4, ack);
+			ReadInteger(header + 8, ack_bits);
+		}
+
+		virtual void OnStop()
+		{
+			ClearData();
+		}
+
+		virtual void OnDisconnect()
+		{
+			ClearData();
+		}
+
+		// acks are only valid until the reliability system updates, so this must run before it does
+
+		void ReleaseAckedPackets()
+		{
+			unsigned int* acks = NULL;
+			int ack_count = 0;
+			reliabilitySystem.GetAcks(&acks, ack_count);
+			PacketPool::Buffer* buffer;
+			for (int i = 0; i < ack_count; ++i)
 			{
-				if (mode == Client && state == Connecting)
-				{
-					printf("client completes connection with server\n");
-					state = Connected;
-					OnConnect();
-				}
-				timeoutAccumulator = 0.0f;
-				memcpy(data, &packet[4], bytes_read - 4);
-				return bytes_read - 4;
+				if (retransmitBuffer.Remove(acks[i], &buffer))
+					pool.Release(buffer);
 			}
-			return 0;
 		}
 
-		int GetHeaderSize() const
+		// lost payloads go out again under a fresh sequence number, so they can be acked (or lost) again
+
+		void ResendLostPackets()
 		{
-			return 4;
+			if (!IsConnected() && !IsConnecting())
+				return;
+			unsigned int* lost = NULL;
+			int lost_count = 0;
+			reliabilitySystem.GetLost(&lost, lost_count);
+			BeginSendBatch();
+			PacketPool::Buffer* buffer;
+			for (int i = 0; i < lost_count; ++i)
+			{
+				if (!retransmitBuffer.Remove(lost[i], &buffer))
+					continue;
+				if (SendBuffer(buffer, true))
+					resent_packets++;
+			}
+			EndSendBatch();
 		}
 
-	protected:
+		// the newest reliable payload goes out again under a fresh sequence, so its ack shows what became of the
+		// packets before it. its old sequence stays pending, and when that is acked or lost there is simply
+		// nothing left under it to release or resend
+		//  + if the newest reliable payload was already acked, the packets before it need no probe
+		//  + if the probe can't be sent the payload goes back under its old sequence, which is still pending
 
-		virtual void OnStart() {}
-		virtual void OnStop() {}
-		virtual void OnConnect() {}
-		virtual void OnDisconnect() {}
+		void SendTailProbe()
+		{
+			if (!IsConnected() && !IsConnecting())
+				return;
+			PacketPool::Buffer* buffer;
+			if (!retransmitBuffer.Remove(newestReliable, &buffer))
+				return;
+			if (SendBuffer(buffer))
+				probe_packets++;
+			else
+				retransmitBuffer.Insert(newestReliable, buffer);
+		}
 
 	private:
 
-		void ClearData()
+		typedef SequenceBuffer<PacketPool::Buffer*> RetransmitBuffer;
+
+		// the buffer is owned by the retransmit buffer once this succeeds
+		//  + a payload that is already out of the caller's hands is retained even if the socket refuses it. it takes
+		//    a sequence as though it were sent and lost, so loss detection sends it again later
+
+		bool SendBuffer(PacketPool::Buffer* buffer, bool retain = false)
 		{
-			state = Disconnected;
-			timeoutAccumulator = 0.0f;
-			address = Address();
+			static_assert(PacketPool::Headroom >= 4 + MaxHeaderSize, "packet pool headroom must fit the connection and reliability headers");
+			const unsigned int sequence = reliabilitySystem.GetLocalSequence();
+			bool sent = true;
+			if (!DropPacket())
+			{
+				// the header size depends on the acks that go with it, so it is built aside and placed in front
+				unsigned char header[MaxHeaderSize];
+				const int headerSize = WritePacketHeader(header);
+				unsigned char* packet = buffer->GetPayload() - headerSize;
+				std::memcpy(packet, header, headerSize);
+				sent = SendPacketInPlace(packet, headerSize + buffer->size);
+				if (!sent && !retain)
+					return false;
+				PacketSent(buffer->size);
+			}
+			retransmitBuffer.Insert(sequence, buffer);
+			newestReliable = sequence;
+			return sent;
 		}
 
-		enum State
+		// the controller may change its rate on any send, ack or loss
+
+		void PacketSent(int size)
 		{
-			Disconnected,
-			Listening,
-			Connecting,
-			ConnectFail,
-			Connected
-		};
+			reliabilitySystem.PacketSent(size, GetTimestamp());
+			UpdatePacingRate();
+			AcksSent();
+		}
 
-		unsigned int protocolId;
-		float timeout;
+		void UpdatePacingRate()
+		{
+			const CongestionControl* congestion = reliabilitySystem.GetCongestionControl();
+			GetPacer().SetRate(congestion ? congestion->GetPacingRate() : 0.0f);
+		}
 
-		bool running;
-		Mode mode;
-		State state;
-		Socket socket;
-		float timeoutAccumulator;
-		Address address;
-	};
+		bool WindowHasRoom(const CongestionControl& congestion, int size) const
+		{
+			const int in_flight = reliabilitySystem.GetBytesInFlight();
+			return in_flight == 0 || in_flight + size <= congestion.GetCongestionWindow();
+		}
 
-	// packet queue to store information about sent and received packets sorted in sequence order
-	//  + we define ordering using the "sequence_more_recent" function, this works provided there is a large gap when sequence wrap occurs
+		// unit tests simulate loss by counting a packet as sent without sending it
 
-	struct PacketData
-	{
-		unsigned int sequence;			// packet sequence number
-		float time;					    // time offset since packet was sent or received (depending on context)
-		int size;						// packet size in bytes
-	};
+		bool DropPacket()
+		{
+#ifdef NET_UNIT_TEST
+			if (reliabilitySystem.GetLocalSequence() & packet_loss_mask)
+			{
+				reliabilitySystem.PacketSent(PacketSizeHack, GetTimestamp());
+				return true;
+			}
+#endif
+			return false;
+		}
 
-	inline bool sequence_more_recent(unsigned int s1, unsigned int s2, unsigned int max_sequence)
-	{
-		auto half_max = max_sequence / 2;
-		return (
-			((s1 > s2) && (s1 - s2 <= half_max))
-			||
-			((s2 > s1) && (s2 - s1 > half_max))
-			);
-	}
+		enum CompactFlags
+		{
+			CompactHeader = 0x80,			// always set, the first bit of a standard header is always clear
+			CompactSequenceBytes = 0x03,	// bytes of the sequence sent, less one
+			CompactAckDelta = 0x04,			// the ack is one byte, counted back from the sequence
+			CompactAckBitsOnes = 0x08,		// the ack bits are left out, all ones
+			CompactAckBitsZero = 0x10,		// the ack bits are left out, all zero
+			CompactExtension = 0x20,		// a byte of ExtensionFlags follows
+			CompactAckOnly = 0x40			// an ack on its own: no sequence, the ack takes 4 bytes and no payload follows
+		};
 
-	class PacketQueue : public std::list<PacketData>
-	{
-	public:
+		enum ExtensionFlags
+		{
+			ExtensionWidth = 0x03,			// width code of the mask in this header
+			ExtensionWidest = 0x0C,			// width code of the widest mask the sender accepts
+			ExtensionWidestShift = 2,
+			ExtensionRanges = 0x10,			// the sender takes ack ranges
+			ExtensionRangesFollow = 0x20	// a count byte and ack ranges follow the mask
+		};
 
-		bool exists(unsigned int sequence)
+		bool IsExtended() const
 		{
-			for (iterator itor = begin(); itor != end(); ++itor)
-				if (itor->sequence == sequence)
-					return true;
-			return false;
+			return ackBits != ReliabilitySystem::AckBits || ackRanges;
 		}
 
-		void insert_sorted(const PacketData& p, unsigned int max_sequence)
+		// ack mask widths go on the wire as 32 << code
+
+		static int GetWidthCode(int bits)
 		{
-			if (empty())
-			{
-				push_back(p);
-			}
-			else
+			for (int code = 0; (32 << code) <= ReliabilitySystem::MaxAckBits; ++code)
 			{
-				if (!sequence_more_recent(p.sequence, front().sequence, max_sequence))
-				{
-					push_front(p);
-				}
-				else if (sequence_more_recent(p.sequence, back().sequence, max_sequence))
-				{
-					push_back(p);
-				}
-				else
-				{
-					for (PacketQueue::iterator itor = begin(); itor != end(); itor++)
-					{
-						assert(itor->sequence != p.sequence);
-						if (sequence_more_recent(itor->sequence, p.sequence, max_sequence))
-						{
-							insert(itor, p);
-							break;
-						}
-					}
-				}
+				if ((32 << code) == bits)
+					return code;
 			}
+			return -1;
 		}
 
-		void verify_sorted(unsigned int max_sequence)
+		static int GetWidthBits(int code)
 		{
-			PacketQueue::iterator prev = end();
-			for (PacketQueue::iterator itor = begin(); itor != end(); itor++)
-			{
-				assert(itor->sequence <= max_sequence);
-				if (prev != end())
-				{
-					assert(sequence_more_recent(itor->sequence, prev->sequence, max_sequence));
-					prev = itor;
-				}
-			}
+			return (32 << code) <= ReliabilitySystem::MaxAckBits ? 32 << code : 0;
 		}
+
+		// largest header we send with this ack width
+
+		int GetReliabilityHeaderSize(int width) const
+		{
+			if (!IsExtended())
+				return compactHeader ? CompactHeaderSize : StandardHeaderSize;
+			return CompactHeaderSize + 1 + (width / 32 - 1) * 4 + (ackRanges ? 1 + ReliabilitySystem::MaxAckRanges * 4 : 0);
+		}
+
+		void ClearData()
+		{
+			peerAckBits = ReliabilitySystem::AckBits;
+			peerAckRanges = false;
+			peerAck = 0;
+			hasPeerAck = false;
+			reliabilitySystem.Reset();
+			PacketPool& pool = this->pool;
+			retransmitBuffer.Clear([&pool](unsigned int, PacketPool::Buffer* buffer) { pool.Release(buffer); });
+			newestReliable = 0;
+			resent_packets = 0;
+			probe_packets = 0;
+			ack_packets = 0;
+			receivedUnacked = 0;
+			ackDeadline = NoDeadline;
+		}
+
+#ifdef NET_UNIT_TEST
+		unsigned int packet_loss_mask;			// mask sequence number, if non-zero, drop packet - for unit test only
+#endif
+
+		ReliabilitySystem reliabilitySystem;	// reliability system: manages sequence numbers and acks, tracks network stats etc.
+		PacketPool pool;						// buffers for reliable payloads, with headroom for the headers
+		int ackBits;							// widest ack mask we want to send and accept
+		int peerAckBits;						// widest ack mask the peer accepts, 32 until it tells us otherwise
+		bool ackRanges;							// we send and take ack ranges
+		bool peerAckRanges;						// the peer takes ack ranges
+		unsigned int peerAck;					// ack field of the last packet from the peer: the newest sequence it has from us
+		bool hasPeerAck;
+		bool compactHeader;						// send compact headers even without the extension
+		int ackFrequency;						// received packets that make an ack go out on its own, zero if never
+		float ackDelay;							// longest an ack waits for something to ride on, seconds
+		int receivedUnacked;					// packets received since acks last went out
+		Timestamp ackDeadline;					// when acks go out on their own if nothing else has carried them
+		RetransmitBuffer retransmitBuffer;		// payloads of reliable packets keyed by the sequence they were last sent with
+		unsigned int newestReliable;			// sequence the most recent reliable payload was sent with
+		unsigned int resent_packets;			// total number of reliable payloads resent after being lost
+		unsigned int probe_packets;				// total number of tail loss probes sent
+		unsigned int ack_packets;				// total number of packets sent only to carry acks
 	};
 
-	// reliability system to support reliable connection		
-	//  + manages sent, received, pending ack and acked packet queues
-	//  + separated out from reliable connection because it is quite complex and i want to unit test it!
+	// server side connection manager
+	//  + owns one bound socket and demultiplexes it into one session per peer address
+	//  + sessions are connections attached to the shared socket, each with its own reliability system and timeout
+	//  + a session is created by the first packet with a valid protocol id from a new address
+	//  + Update only visits sessions that received a packet since the last update and sessions whose deadline has
+	//    passed, which are kept in a min heap, so a wake up costs the same with ten sessions or ten thousand
+	//  + a session that changes its deadline any other way (sending from outside its own Update) must be passed to Wake
+	//  + sessions that disconnect (time out, or stop themselves) are deleted by Update
 
-	class ReliabilitySystem
+	template <typename T> class ConnectionManager
 	{
 	public:
 
-		ReliabilitySystem(unsigned int max_sequence = 0xFFFFFFFF)
-		{
-			this->rtt_maximum = rtt_maximum;
-			this->max_sequence = max_sequence;
-			Reset();
-		}
+		typedef std::function<void(T& session, const unsigned char data[], int size)> SessionPacketHandler;
 
-		void Reset()
+		ConnectionManager(unsigned int protocolId, float timeout, int maxSessions = 4096)
 		{
-			local_sequence = 0;
-			remote_sequence = 0;
-			sentQueue.clear();
-			receivedQueue.clear();
-			pendingAckQueue.clear();
-			ackedQueue.clear();
-			sent_packets = 0;
-			recv_packets = 0;
-			lost_packets = 0;
-			acked_packets = 0;
-			sent_bandwidth = 0.0f;
-			acked_bandwidth = 0.0f;
-			rtt = 0.0f;
-			rtt_maximum = 1.0f;
+			this->protocolId = protocolId;
+			this->timeout = timeout;
+			this->maxSessions = maxSessions;
+			running = false;
 		}
 
-		void PacketSent(int size)
+		~ConnectionManager()
 		{
-			if (sentQueue.exists(local_sequence))
-			{
-				printf("local sequence %d exists\n", local_sequence);
-				for (PacketQueue::iterator itor = sentQueue.begin(); itor != sentQueue.end(); ++itor)
-					printf(" + %d\n", itor->sequence);
-			}
-			assert(!sentQueue.exists(local_sequence));
-			assert(!pendingAckQueue.exists(local_sequence));
-			PacketData data;
-			data.sequence = local_sequence;
-			data.time = 0.0f;
-			data.size = size;
-			sentQueue.push_back(data);
-			pendingAckQueue.push_back(data);
-			sent_packets++;
-			local_sequence++;
-			if (local_sequence > max_sequence)
-				local_sequence = 0;
+			if (IsRunning())
+				Stop();
 		}
 
-		void PacketReceived(unsigned int sequence, int size)
+		bool Start(int port)
 		{
-			recv_packets++;
-			if (receivedQueue.exists(sequence))
-				return;
-			PacketData data;
-			data.sequence = sequence;
-			data.time = 0.0f;
-			data.size = size;
-			receivedQueue.push_back(data);
-			if (sequence_more_recent(sequence, remote_sequence, max_sequence))
-				remote_sequence = sequence;
+			assert(!running);
+			printf("start connection manager on port %d\n", port);
+			if (!socket.Open(port))
+				return false;
+			running = true;
+			return true;
 		}
 
-		unsigned int GenerateAckBits()
+		void Stop()
 		{
-			return generate_ack_bits(GetRemoteSequence(), receivedQueue, max_sequence);
+			assert(running);
+			printf("stop connection manager\n");
+			for (int i = 0; i < sessions.GetCapacity(); ++i)
+			{
+				if (!sessions.IsUsed(i))
+					continue;
+				delete sessions.GetValue(i)->connection;
+				delete sessions.GetValue(i);
+			}
+			sessions.Clear();
+			heap.clear();
+			woken.clear();
+			reader.Clear();
+			socket.Close();
+			running = false;
 		}
 
-		void ProcessAck(unsigned int ack, unsigned int ack_bits)
+		bool IsRunning() const
 		{
-			process_ack(ack, ack_bits, pendingAckQueue, ackedQueue, acks, acked_packets, rtt, max_sequence);
+			return running;
 		}
 
-		void Update(float deltaTime)
+		bool EnableOffload()
 		{
-			acks.clear();
-			AdvanceQueueTime(deltaTime);
-			UpdateQueues();
-			UpdateStats();
-#ifdef NET_UNIT_TEST
-			Validate();
-#endif
+			assert(running);
+			return socket.EnableOffload();
 		}
 
-		void Validate()
+		const Socket& GetSocket() const
 		{
-			sentQueue.verify_sorted(max_sequence);
-			receivedQueue.verify_sorted(max_sequence);
-			pendingAckQueue.verify_sorted(max_sequence);
-			ackedQueue.verify_sorted(max_sequence);
+			return socket;
 		}
 
-		// utility functions
+		// receives until the socket has nothing left or the budget is used up, handing each payload to the handler
+		// together with the session it belongs to. a budget of zero means no limit, and as with Connection::ReceivePackets
+		// the payload is only valid during the handler call
 
-	/*
-		static bool sequence_more_recent( unsigned int s1, unsigned int s2, unsigned int max_sequence )
+		int ReceivePackets(const SessionPacketHandler& handler, int maxPackets = 0, float maxSeconds = 0.0f)
 		{
-			return ( s1 > s2 ) && ( s1 - s2 <= max_sequence/2 ) || ( s2 > s1 ) && ( s2 - s1 > max_sequence/2 );
+			assert(running);
+			PacketView view;
+			return reader.Drain(socket, [&](const Address& sender, const unsigned char packet[], int bytes_read)
+			{
+				Session** found = sessions.Find(sender);
+				Session* session = found ? *found : Accept(sender, packet, bytes_read);
+				if (!session)
+					return false;
+				// even a packet that only carries acks gives the session something to do
+				Wake(session);
+				if (!session->connection->ReceiveDatagram(sender, packet, bytes_read, view))
+					return false;
+				handler(*session->connection, view.data, view.size);
+				return true;
+			}, maxPackets, maxSeconds);
 		}
-	*/
 
-		static int bit_index_for_sequence(unsigned int sequence, unsigned int ack, unsigned int max_sequence)
+		// updates the sessions that received packets and the sessions whose deadline has passed, each with the
+		// time since its own last update
+
+		void Update(Timestamp now)
 		{
-			assert(sequence != ack);
-			assert(!sequence_more_recent(sequence, ack, max_sequence));
-			if (sequence > ack)
+			assert(running);
+			while (!heap.empty() && heap[0]->deadline <= now)
 			{
-				assert(ack < 33);
-				assert(max_sequence >= sequence);
-				return ack + (max_sequence - sequence);
+				Session* session = heap[0];
+				RemoveFromHeap(session);
+				Wake(session);
 			}
-			else
+			// a session woken during the walk waits for the next update
+			due.swap(woken);
+			woken.clear();
+			for (size_t i = 0; i < due.size(); ++i)
 			{
-				assert(ack >= 1);
-				assert(sequence <= ack - 1);
-				return ack - 1 - sequence;
+				Session* session = due[i];
+				session->woken = false;
+				T* connection = session->connection;
+				connection->Update(TimestampToSeconds(now - session->lastUpdate));
+				session->lastUpdate = now;
+				if (!connection->IsConnected())
+					RemoveSession(session->address);
+				else
+					Schedule(session, connection->GetNextDeadline(now));
 			}
+			due.clear();
 		}
 
-		static unsigned int generate_ack_bits(unsigned int ack, const PacketQueue& received_queue, unsigned int max_sequence)
+		// earliest time Update has something to do, used to decide how long to sleep
+
+		Timestamp GetNextDeadline(Timestamp now) const
 		{
-			unsigned int ack_bits = 0;
-			for (PacketQueue::const_iterator itor = received_queue.begin(); itor != received_queue.end(); itor++)
-			{
-				if (itor->sequence == ack || sequence_more_recent(itor->sequence, ack, max_sequence))
-					break;
-				int bit_index = bit_index_for_sequence(itor->sequence, ack, max_sequence);
-				if (bit_index <= 31)
-					ack_bits |= 1 << bit_index;
-			}
-			return ack_bits;
+			if (reader.HasPending() || !woken.empty())
+				return now;
+			return heap.empty() ? NoDeadline : heap[0]->deadline;
 		}
 
-		static void process_ack(unsigned int ack, unsigned int ack_bits,
-			PacketQueue& pending_ack_queue, PacketQueue& acked_queue,
-			std::vector<unsigned int>& acks, unsigned int& acked_packets,
-			float& rtt, unsigned int max_sequence)
+		// has Update visit this session, and so pick up its new deadline
+
+		void Wake(const Address& address)
 		{
-			if (pending_ack_queue.empty())
-				return;
+			Session** session = sessions.Find(address);
+			if (session)
+				Wake(*session);
+		}
 
-			PacketQueue::iterator itor = pending_ack_queue.begin();
-			while (itor != pending_ack_queue.end())
-			{
-				bool acked = false;
+		T* FindSession(const Address& address)
+		{
+			Session** session = sessions.Find(address);
+			return session ? (*session)->connection : NULL;
+		}
 
-				if (itor->sequence == ack)
-				{
-					acked = true;
-				}
-				else if (!sequence_more_recent(itor->sequence, ack, max_sequence))
-				{
-					int bit_index = bit_index_for_sequence(itor->sequence, ack, max_sequence);
-					if (bit_index <= 31)
-						acked = (ack_bits >> bit_index) & 1;
-				}
+		void RemoveSession(const Address& address)
+		{
+			Session** found = sessions.Find(address);
+			if (!found)
+				return;
+			Session* session = *found;
+			sessions.Erase(address);
+			if (session->heapIndex >= 0)
+				RemoveFromHeap(session);
+			if (session->woken)
+				woken.erase(std::find(woken.begin(), woken.end(), session));
+			delete session->connection;
+			delete session;
+		}
 
-				if (acked)
-				{
-					rtt += (itor->time - rtt) * 0.1f;
+		// calls function( T& session ) for every session. sessions must not be added or removed meanwhile
 
-					acked_queue.insert_sorted(*itor, max_sequence);
-					acks.push_back(itor->sequence);
-					acked_packets++;
-					itor = pending_ack_queue.erase(itor);
-				}
-				else
-					++itor;
+		template <typename Function> void ForEachSession(Function function)
+		{
+			for (int i = 0; i < sessions.GetCapacity(); ++i)
+			{
+				if (sessions.IsUsed(i))
+					function(*sessions.GetValue(i)->connection);
 			}
 		}
 
-		// data accessors
+		int GetSessionCount() const
+		{
+			return sessions.Size();
+		}
+
+	private:
 
-		unsigned int GetLocalSequence() const
+		struct Session
 		{
-			return local_sequence;
+			T* connection;
+			Address address;
+			Timestamp lastUpdate;
+			Timestamp deadline;			// valid while in the heap
+			int heapIndex;				// -1 while not in the heap
+			bool woken;					// waiting in the list for the next update
+		};
+
+		ConnectionManager(const ConnectionManager&);
+		ConnectionManager& operator = (const ConnectionManager&);
+
+		Session* Accept(const Address& sender, const unsigned char packet[], int bytes_read)
+		{
+			if (!Connection::HasProtocolId(packet, bytes_read, protocolId))
+				return NULL;
+			if (sessions.Size() >= maxSessions)
+				return NULL;
+			printf("server accepts connection from client %d.%d.%d.%d:%d\n",
+				sender.GetA(), sender.GetB(), sender.GetC(), sender.GetD(), sender.GetPort());
+			Session* session = new Session;
+			session->connection = new T(protocolId, timeout);
+			session->connection->Attach(socket, sender);
+			session->address = sender;
+			session->lastUpdate = GetTimestamp();
+			session->deadline = NoDeadline;
+			session->heapIndex = -1;
+			session->woken = false;
+			sessions.Insert(sender, session);
+			return session;
 		}
 
-		unsigned int GetRemoteSequence() const
+		void Wake(Session* session)
 		{
-			return remote_sequence;
+			if (session->woken)
+				return;
+			session->woken = true;
+			woken.push_back(session);
 		}
 
-		unsigned int GetMaxSequence() const
+		void Schedule(Session* session, Timestamp deadline)
 		{
-			return max_sequence;
+			if (deadline == NoDeadline)
+			{
+				if (session->heapIndex >= 0)
+					RemoveFromHeap(session);
+				return;
+			}
+			session->deadline = deadline;
+			if (session->heapIndex < 0)
+			{
+				session->heapIndex = (int)heap.size();
+				heap.push_back(session);
+			}
+			Sift(session->heapIndex);
 		}
 
-		void GetAcks(unsigned int** acks, int& count)
+		void RemoveFromHeap(Session* session)
 		{
-			*acks = &this->acks[0];
-			count = (int)this->acks.size();
+			const int index = session->heapIndex;
+			Session* last = heap.back();
+			heap.pop_back();
+			session->heapIndex = -1;
+			if (last == session)
+				return;
+			heap[index] = last;
+			last->heapIndex = index;
+			Sift(index);
 		}
 
-		unsigned int GetSentPackets() const
+		// moves the entry at index up or down until the heap is in order again
+
+		void Sift(int index)
 		{
-			return sent_packets;
+			while (index > 0)
+			{
+				const int parent = (index - 1) / 2;
+				if (heap[parent]->deadline <= heap[index]->deadline)
+					break;
+				Swap(index, parent);
+				index = parent;
+			}
+			const int count = (int)heap.size();
+			while (true)
+			{
+				int smallest = index;
+				const int left = index * 2 + 1;
+				const int right = left + 1;
+				if (left < count && heap[left]->deadline < heap[smallest]->deadline)
+					smallest = left;
+				if (right < count && heap[right]->deadline < heap[smallest]->deadline)
+					smallest = right;
+				if (smallest == index)
+					break;
+				Swap(index, smallest);
+				index = smallest;
+			}
 		}
 
-		unsigned int GetReceivedPackets() const
+		void Swap(int a, int b)
 		{
-			return recv_packets;
+			std::swap(heap[a], heap[b]);
+			heap[a]->heapIndex = a;
+			heap[b]->heapIndex = b;
 		}
 
-		unsigned int GetLostPackets() const
+		unsigned int protocolId;
+		float timeout;
+		int maxSessions;
+		bool running;
+		Socket socket;
+		AddressTable<Session*> sessions;		// sessions keyed by peer address
+		std::vector<Session*> heap;				// sessions with a deadline, earliest first
+		std::vector<Session*> woken;			// sessions for the next update to visit
+		std::vector<Session*> due;				// scratch list for Update
+		DatagramReader reader;
+	};
+
+#ifdef NET_UNIT_TEST
+
+	// a reliable connection with its wire format opened up, so two of them can talk through a buffer
+
+	class TestConnection : public ReliableConnection
+	{
+	public:
+
+		TestConnection(unsigned int max_sequence)
+			: ReliableConnection(0, 10.0f, max_sequence)
 		{
-			return lost_packets;
 		}
 
-		unsigned int GetAckedPackets() const
+		using ReliableConnection::WritePacketHeader;
+		using ReliableConnection::ReadCompactHeader;
+		using ReliableConnection::WriteRange;
+		using ReliableConnection::ReadRange;
+		using ReliableConnection::ReadSequence;
+
+		// the next packet to the peer: a header and a byte of payload. returns its size
+
+		int Write(unsigned char packet[])
 		{
-			return acked_packets;
+			int size = WritePacketHeader(packet);
+			packet[size++] = 0;
+			GetReliabilitySystem().PacketSent(1);
+			return size;
 		}
 
-		float GetSentBandwidth() const
+		// a packet from the peer as ReadPayload sees it, once the connection has taken off its own header.
+		// returns false for an ack on its own
+
+		bool Read(const unsigned char packet[], int size, PacketView& view)
 		{
-			return sent_bandwidth;
+			view = PacketView();
+			view.data = packet;
+			view.size = size;
+			return ReadPayload(view);
 		}
+	};
 
-		float GetAckedBandwidth() const
+	// unit tests, built in with NET_UNIT_TEST defined and run by UnitTest::Run
+	//  + they check what has to hold across the wrap of the sequence space and through the wire formats
+	//  + a failed check is printed and counted, and the tests carry on so one run shows everything that broke
+
+	class UnitTest
+	{
+	public:
+
+		static bool Run()
 		{
-			return acked_bandwidth;
+			UnitTest test;
+			test.TestPacketQueue();
+			test.TestAddressTable();
+			test.TestAckBits();
+			test.TestAckRanges();
+			test.TestCompactSequence();
+			test.TestCompactLink();
+			printf("unit tests: %d checks, %d failed\n", test.checks, test.failures);
+			return test.failures == 0;
 		}
 
-		float GetRoundTripTime() const
+	private:
+
+		UnitTest()
 		{
-			return rtt;
+			checks = 0;
+			failures = 0;
+			state = 0x12345678;
 		}
 
-		int GetHeaderSize() const
+		void Check(bool condition, const char* what, unsigned int value)
 		{
-			return 12;
+			checks++;
+			if (condition)
+				return;
+			failures++;
+			printf("check failed: %s (%u)\n", what, value);
 		}
 
-	protected:
+		// xorshift, so every run sees the same numbers and a failure reproduces
 
-		void AdvanceQueueTime(float deltaTime)
+		unsigned int Random()
 		{
-			for (PacketQueue::iterator itor = sentQueue.begin(); itor != sentQueue.end(); itor++)
-				itor->time += deltaTime;
-
-			for (PacketQueue::iterator itor = receivedQueue.begin(); itor != receivedQueue.end(); itor++)
-				itor->time += deltaTime;
+			state ^= state << 13;
+			state ^= state >> 17;
+			state ^= state << 5;
+			return state;
+		}
 
-			for (PacketQueue::iterator itor = pendingAckQueue.begin(); itor != pendingAckQueue.end(); itor++)
-				itor->time += deltaTime;
+		// the ring against a sorted list of what it should hold, across the wrap of several sequence spaces
+		//  + sequences arrive with gaps, some of them late, and some are erased out of the middle
 
-			for (PacketQueue::iterator itor = ackedQueue.begin(); itor != ackedQueue.end(); itor++)
-				itor->time += deltaTime;
+		void TestPacketQueue()
+		{
+			// all of them a power of two, so a sequence wraps with a mask
+			const unsigned int spaces[] = { 0xFF, 0x3FF, 0xFFFF, 0x7FFFFFFF, 0xFFFFFFFF };
+			const int capacity = 64;
+			for (unsigned int max_sequence : spaces)
+			{
+				PacketQueue queue(max_sequence, capacity);
+				std::vector<unsigned int> expected;		// oldest first
+				unsigned int sequence = max_sequence - 200;
+				for (int i = 0; i < 5000; ++i, sequence = sequence_next(sequence, max_sequence))
+				{
+					const unsigned int roll = Random() % 8;
+					if (roll == 0)
+						continue;
+					if (roll == 1 && !expected.empty())
+					{
+						const size_t erased = Random() % expected.size();
+						Check(queue.erase(expected[erased]), "queue erase", expected[erased]);
+						expected.erase(expected.begin() + erased);
+						CheckQueue(queue, expected, sequence);
+					}
+					if (roll == 2)
+					{
+						const unsigned int late = (sequence - 1 - Random() % (capacity + 8)) & max_sequence;
+						if (std::find(expected.begin(), expected.end(), late) == expected.end())
+							Insert(queue, expected, late, capacity, max_sequence);
+					}
+					Insert(queue, expected, sequence, capacity, max_sequence);
+					const unsigned int probe = (sequence - Random() % (2 * capacity)) & max_sequence;
+					Check(queue.exists(probe) == (std::find(expected.begin(), expected.end(), probe) != expected.end()), "queue exists", probe);
+				}
+			}
 		}
 
-		void UpdateQueues()
+		void CheckQueue(PacketQueue& queue, const std::vector<unsigned int>& expected, unsigned int sequence)
 		{
-			const float epsilon = 0.001f;
+			Check(queue.size() == (int)expected.size(), "queue size", sequence);
+			if (queue.empty() || expected.empty())
+				return;
+			Check(queue.front().sequence == expected.front(), "queue front", sequence);
+			Check(queue.back().sequence == expected.back(), "queue back", sequence);
+			size_t index = 0;
+			for (PacketQueue::iterator itor = queue.begin(); itor != queue.end(); ++itor, ++index)
+				Check(index < expected.size() && itor->sequence == expected[index], "queue order", sequence);
+			Check(index == expected.size(), "queue iteration", sequence);
+		}
 
-			while (sentQueue.size() && sentQueue.front().time > rtt_maximum + epsilon)
-				sentQueue.pop_front();
+		// inserts into the queue and into the list the way the queue should: a newer sequence pushes out
+		// whatever is a capacity or more behind it, an older one is turned away if it is that far behind
 
-			if (receivedQueue.size())
+		void Insert(PacketQueue& queue, std::vector<unsigned int>& expected, unsigned int sequence, int capacity, unsigned int max_sequence)
+		{
+			bool accepted = true;
+			if (expected.empty() || sequence_more_recent(sequence, expected.back(), max_sequence))
 			{
-				const unsigned int latest_sequence = receivedQueue.back().sequence;
-				const unsigned int minimum_sequence = latest_sequence >= 34 ? (latest_sequence - 34) : max_sequence - (34 - latest_sequence);
-				while (receivedQueue.size() && !sequence_more_recent(receivedQueue.front().sequence, minimum_sequence, max_sequence))
-					receivedQueue.pop_front();
+				while (!expected.empty() && sequence_distance(sequence, expected.front(), max_sequence) >= (unsigned int)capacity)
+					expected.erase(expected.begin());
+				expected.push_back(sequence);
 			}
-
-			while (ackedQueue.size() && ackedQueue.front().time > rtt_maximum * 2 - epsilon)
-				ackedQueue.pop_front();
-
-			while (pendingAckQueue.size() && pendingAckQueue.front().time > rtt_maximum + epsilon)
+			else if (sequence_distance(expected.back(), sequence, max_sequence) >= (unsigned int)capacity)
+				accepted = false;
+			else
 			{
-				pendingAckQueue.pop_front();
-				lost_packets++;
+				std::vector<unsigned int>::iterator itor = expected.begin();
+				while (itor != expected.end() && sequence_more_recent(sequence, *itor, max_sequence))
+					++itor;
+				expected.insert(itor, sequence);
 			}
+			PacketData data;
+			data.sequence = sequence;
+			data.time = 0;
+			data.size = 1;
+			Check(queue.insert(data) == accepted, "queue insert", sequence);
+			CheckQueue(queue, expected, sequence);
 		}
 
-		void UpdateStats()
+		// the table against std::map through a churn of inserts, erases and lookups
+		//  + addresses come from a small pool, so the probe chains run long and most erases shift entries back
+
+		void TestAddressTable()
 		{
-			int sent_bytes_per_second = 0;
-			for (PacketQueue::iterator itor = sentQueue.begin(); itor != sentQueue.end(); ++itor)
-				sent_bytes_per_second += itor->size;
-			int acked_packets_per_second = 0;
-			int acked_bytes_per_second = 0;
-			for (PacketQueue::iterator itor = ackedQueue.begin(); itor != ackedQueue.end(); ++itor)
+			AddressTable<int> table(4);
+			std::map<unsigned long long, int> expected;
+			for (int i = 0; i < 200000; ++i)
 			{
-				if (itor->time >= rtt_maximum)
+				const unsigned int random = Random();
+				const Address address(10, 0, (unsigned char)(random & 3), (unsigned char)((random >> 2) & 0x3F), (unsigned short)(1 + (random >> 8) % 8));
+				switch (Random() % 3)
+				{
+					case 0:
+						Check(table.Insert(address, i) == expected.insert(std::make_pair(address.GetKey(), i)).second, "table insert", i);
+						break;
+					case 1:
+						Check(table.Erase(address) == (expected.erase(address.GetKey()) > 0), "table erase", i);
+						break;
+					default:
+					{
+						const int* value = table.Find(address);
+						const std::map<unsigned long long, int>::const_iterator itor = expected.find(address.GetKey());
+						Check((value != NULL) == (itor != expected.end()) && (value == NULL || *value == itor->second), "table find", i);
+					}
+				}
+				Check(table.Size() == (int)expected.size(), "table size", i);
+				if (i % 1000 != 0)
+					continue;
+				// every entry is reachable from its slot, and nothing else is there
+				int used = 0;
+				for (int slot = 0; slot < table.GetCapacity(); ++slot)
 				{
-					acked_packets_per_second++;
-					acked_bytes_per_second += itor->size;
+					if (!table.IsUsed(slot))
+						continue;
+					used++;
+					const Address address = table.GetAddress(slot);
+					const std::map<unsigned long long, int>::const_iterator itor = expected.find(address.GetKey());
+					Check(itor != expected.end() && table.GetValue(slot) == itor->second, "table slot", i);
+					Check(table.Find(address) == &table.GetValue(slot), "table slot find", i);
 				}
+				Check(used == (int)expected.size(), "table slots used", i);
 			}
-			sent_bytes_per_second /= rtt_maximum;
-			acked_bytes_per_second /= rtt_maximum;
-			sent_bandwidth = sent_bytes_per_second * (8 / 1000.0f);
-			acked_bandwidth = acked_bytes_per_second * (8 / 1000.0f);
 		}
 
-	private:
-
-		unsigned int max_sequence;			// maximum sequence value before wrap around (used to test sequence wrap at low # values)
-		unsigned int local_sequence;		// local sequence number for most recently sent packet
-		unsigned int remote_sequence;		// remote sequence number for most recently received packet
-
-		unsigned int sent_packets;			// total number of packets sent
-		unsigned int recv_packets;			// total number of packets received
-		unsigned int lost_packets;			// total number of packets lost
-		unsigned int acked_packets;			// total number of packets acked
-
-		float sent_bandwidth;				// approximate sent bandwidth over the last second
-		float acked_bandwidth;				// approximate acked bandwidth over the last second
-		float rtt;							// estimated round trip time
-		float rtt_maximum;					// maximum expected round trip time (hard coded to one second for the moment)
+		// ack masks of every width, with the ack sitting on either side of the wrap
+		//  + bit indices and sequences map back onto each other
+		//  + a mask built from what arrived acks exactly the pending packets it covers, and no others
+		//  + a mask written into a compact header is read back word for word by the peer
 
-		std::vector<unsigned int> acks;		// acked packets from last set of packet receives. cleared each update!
+		void TestAckBits()
+		{
+			const unsigned int spaces[] = { 0xFFFF, 0x7FFFFFFF, 0xFFFFFFFF };
+			for (unsigned int max_sequence : spaces)
+			{
+				const unsigned int acks[] = { 0, 1, 31, 32, 255, 256, max_sequence / 2, max_sequence / 2 + 1, max_sequence - 1, max_sequence };
+				for (unsigned int ack : acks)
+				{
+					for (int bit = 0; bit < ReliabilitySystem::MaxAckBits; ++bit)
+					{
+						const unsigned int sequence = ReliabilitySystem::sequence_for_bit_index(bit, ack, max_sequence);
+						Check(sequence <= max_sequence && sequence_distance(ack, sequence, max_sequence) == (unsigned int)bit + 1, "ack bit sequence", ack);
+						Check(ReliabilitySystem::bit_index_for_sequence(sequence, ack, max_sequence) == bit, "ack bit index", ack);
+					}
+					for (int words = 1; words <= ReliabilitySystem::MaxAckWords; words *= 2)
+						TestAckMask(ack, words, max_sequence);
+				}
+			}
 
-		PacketQueue sentQueue;				// sent packets used to calculate sent bandwidth (kept until rtt_maximum)
-		PacketQueue pendingAckQueue;		// sent packets which have not been acked yet (kept until rtt_maximum * 2 )
-		PacketQueue receivedQueue;			// received packets for determining acks to send (kept up to most recent recv sequence - 32)
-		PacketQueue ackedQueue;				// acked packets (kept until rtt_maximum * 2)
-	};
+			for (int width = ReliabilitySystem::AckBits; width <= ReliabilitySystem::MaxAckBits; width *= 2)
+			{
+				const unsigned int wire_spaces[] = { 0xFFFF, 0x7FFFFFFF };
+				for (unsigned int max_sequence : wire_spaces)
+				{
+					const unsigned int acks[] = { 3, 100, max_sequence / 2 + 7, max_sequence - 2 };
+					for (unsigned int ack : acks)
+						TestAckMaskHeader(ack, width, max_sequence);
+				}
+			}
+		}
 
-	// connection with reliability (seq/ack)
+		void TestAckMask(unsigned int ack, int words, unsigned int max_sequence)
+		{
+			const unsigned int window = words * 32 + 16;
+			PacketQueue received(max_sequence, 2 * ReliabilitySystem::AckHistory);
+			PacketQueue pending(max_sequence);
+			PacketQueue acked(max_sequence);
+			PacketData data;
+			data.time = 0;
+			data.size = 1;
+			data.sequence = (ack - window) & max_sequence;
+			for (unsigned int back = window; back != (unsigned int)-1; --back, data.sequence = sequence_next(data.sequence, max_sequence))
+			{
+				pending.insert(data);
+				if (back == 0 || Random() % 3 != 0)
+					received.insert(data);
+			}
 
-	class ReliableConnection : public Connection
-	{
-	public:
+			unsigned int ack_bits[ReliabilitySystem::MaxAckWords];
+			ReliabilitySystem::generate_ack_bits(ack, received, max_sequence, ack_bits, words);
+			std::vector<unsigned int> acked_sequences;
+			unsigned int acked_packets = 0;
+			RoundTripEstimator round_trip;
+			ReliabilitySystem::process_ack(ack, ack_bits, words, pending, acked, acked_sequences, acked_packets, round_trip, 0, max_sequence);
 
-		ReliableConnection(unsigned int protocolId, float timeout, unsigned int max_sequence = 0xFFFFFFFF)
-			: Connection(protocolId, timeout), reliabilitySystem(max_sequence)
-		{
-			ClearData();
-#ifdef NET_UNIT_TEST
-			packet_loss_mask = 0;
-#endif
+			unsigned int expected = 0;
+			unsigned int sequence = ack;
+			for (unsigned int back = 0; back <= window; ++back, sequence = sequence_prev(sequence, max_sequence))
+			{
+				const bool covered = received.exists(sequence) && back <= (unsigned int)words * 32;
+				Check(acked.exists(sequence) == covered && pending.exists(sequence) == !covered, "ack mask", sequence);
+				if (covered)
+					expected++;
+			}
+			Check(acked_sequences.size() == expected && acked_packets == expected, "ack mask count", ack);
 		}
 
-		~ReliableConnection()
+		void TestAckMaskHeader(unsigned int ack, int width, unsigned int max_sequence)
 		{
-			if (IsRunning())
-				Stop();
+			TestConnection sender(max_sequence);
+			TestConnection receiver(max_sequence);
+			sender.SetCompactHeader(true);
+			sender.SetAckBits(width);
+			receiver.SetAckBits(width);
+
+			// the sender learns how wide a mask the receiver takes from the receiver's headers
+			unsigned char packet[ReliableConnection::MaxHeaderSize];
+			PacketView view;
+			sender.Read(packet, receiver.WritePacketHeader(packet, true), view);
+			Check(sender.GetAckBits() == width, "ack width agreed", width);
+
+			ReliabilitySystem& reliability = sender.GetReliabilitySystem();
+			std::vector<bool> received(width + 9);		// by distance back from the ack
+			unsigned int sequence = (ack - width - 8) & max_sequence;
+			for (int back = width + 8; back >= 0; --back, sequence = sequence_next(sequence, max_sequence))
+			{
+				received[back] = back == 0 || Random() % 3 != 0;
+				if (received[back])
+					reliability.PacketReceived(sequence, 1, 0);
+			}
+			Check(reliability.GetRemoteSequence() == ack, "ack mask remote sequence", ack);
+
+			const int size = sender.WritePacketHeader(packet, true);
+			unsigned int ack_bits[ReliabilitySystem::MaxAckWords];
+			int words = 1;
+			AckRange ranges[ReliabilitySystem::MaxAckRanges];
+			int range_count = 0;
+			view = PacketView();
+			view.data = packet;
+			view.size = size;
+			Check(receiver.ReadCompactHeader(view, ack_bits, words, ranges, range_count) == size, "ack mask header size", width);
+			Check(view.ack == ack && words == width / 32 && range_count == 0, "ack mask header", width);
+			for (int bit = 0; bit < words * 32 && bit < width; ++bit)
+				Check(((ack_bits[bit / 32] >> (bit % 32)) & 1) == (received[bit + 1] ? 1u : 0u), "ack mask header bit", bit);
 		}
 
-		// overriden functions from "Connection"
+		// ack ranges with the ack on either side of the wrap
+		//  + a range goes on the wire relative to the ack and comes back as it was
+		//  + the ranges built from a history of bursty loss are the newest runs beyond the mask, and ack only those
+		//  + ranges written into a compact header are read back as they were built
 
-		virtual bool SendPacket(const unsigned char data[], int dataSize) override
+		void TestAckRanges()
 		{
-#ifdef NET_UNIT_TEST
-			if (reliabilitySystem.GetLocalSequence() & packet_loss_mask)
+			const unsigned int spaces[] = { 0xFFFF, 0x7FFFFFFF };
+			for (unsigned int max_sequence : spaces)
 			{
-				reliabilitySystem.PacketSent(PacketSizeHack);
-				return true;
+				TestConnection connection(max_sequence);
+				const unsigned int acks[] = { 0, 5, 300, max_sequence / 2, max_sequence / 2 + 1, max_sequence - 3, max_sequence };
+				const unsigned int distances[] = { 0, 1, 255, 256, 1023 };
+				const unsigned int counts[] = { 1, 2, 37, 1024 };
+				for (unsigned int ack : acks)
+				{
+					for (unsigned int distance : distances)
+					{
+						for (unsigned int count : counts)
+						{
+							AckRange range;
+							range.count = count;
+							range.first = (ack - distance - (count - 1)) & max_sequence;
+							unsigned char data[4];
+							connection.WriteRange(data, ack, range);
+							AckRange read;
+							connection.ReadRange(data, ack, read);
+							Check(read.first == range.first && read.count == range.count, "ack range wire", ack);
+						}
+					}
+					for (int width = ReliabilitySystem::AckBits; width <= ReliabilitySystem::MaxAckBits; width *= 2)
+					{
+						TestAckRangeHistory(ack, width, 0, max_sequence);
+						TestAckRangeHistory(ack, width, 1 + Random() % ReliabilitySystem::MaxAckRanges, max_sequence);
+					}
+				}
+				for (int width = ReliabilitySystem::AckBits; width <= ReliabilitySystem::MaxAckBits; width *= 2)
+				{
+					TestAckRangeHeader(3, width, max_sequence);
+					TestAckRangeHeader(max_sequence - 100, width, max_sequence);
+				}
 			}
-#endif
-			const int header = 12;;
-			//unsigned char packet[header + PacketSizeHack];
-			std::vector<unsigned char> packet(header + dataSize);
-			unsigned int seq = reliabilitySystem.GetLocalSequence();
-			unsigned int ack = reliabilitySystem.GetRemoteSequence();
-			unsigned int ack_bits = reliabilitySystem.GenerateAckBits();
-			WriteHeader(&packet[0], seq, ack, ack_bits);
-			std::memcpy(&packet[header], data, dataSize);
-			if (!Connection::SendPacket(&packet[0], header + dataSize))
-				return false;
-			reliabilitySystem.PacketSent(dataSize);
-			return true;
 		}
 
-		virtual int ReceivePacket(unsigned char data[], int PacketSizeHack) override
-		{
-			const int header = 12;
-			if (PacketSizeHack <= header)
-				return false;
-			//unsigned char packet[header + PacketSizeHack];
-			std::vector<unsigned char> packet(header + PacketSizeHack);
-			int received_bytes = Connection::ReceivePacket(&packet[0], PacketSizeHack + header);
-			if (received_bytes == 0)
-				return false;
-			if (received_bytes <= header)
-				return false;
-			unsigned int packet_sequence = 0;
-			unsigned int packet_ack = 0;
-			unsigned int packet_ack_bits = 0;
-			ReadHeader(&packet[0], packet_sequence, packet_ack, packet_ack_bits); // Extract header information
-			// Notify reliability system about the received packet
-			reliabilitySystem.PacketReceived(packet_sequence, received_bytes - header);
-			reliabilitySystem.ProcessAck(packet_ack, packet_ack_bits);
-			// Extract the message from the packet
-			std::memcpy(data, &packet[0] + header, received_bytes - header);
-			return received_bytes - header;
-		}
+		// marks runs of packets received and lost back from the ack, which is always received
 
-		void Update(float deltaTime)
+		void ReceiveBursts(std::vector<bool>& received)
 		{
-			Connection::Update(deltaTime);
-			reliabilitySystem.Update(deltaTime);
+			bool arrived = true;
+			for (size_t back = 0; back < received.size(); )
+			{
+				const size_t run = 1 + Random() % 24;
+				for (size_t i = 0; i < run && back < received.size(); ++i, ++back)
+					received[back] = arrived || back == 0;
+				arrived = !arrived;
+			}
 		}
 
-		int GetHeaderSize() const
-		{
-			return Connection::GetHeaderSize() + reliabilitySystem.GetHeaderSize();
-		}
+		// only the ack and a few runs arrived, the oldest of them right at the end of the history
 
-		ReliabilitySystem& GetReliabilitySystem()
+		void ReceiveRuns(std::vector<bool>& received, int runs)
 		{
-			return reliabilitySystem;
+			std::fill(received.begin(), received.end(), false);
+			received[0] = true;
+			for (int i = 0; i < runs; ++i)
+			{
+				const size_t length = 1 + Random() % 24;
+				const size_t start = i == 0 ? received.size() - length : 1 + Random() % (received.size() - 1);
+				for (size_t back = start; back < start + length && back < received.size(); ++back)
+					received[back] = true;
+			}
 		}
 
-		// unit test controls
+		// runs is zero for bursty loss throughout, otherwise the number of runs that arrived
 
-#ifdef NET_UNIT_TEST
-		void SetPacketLossMask(unsigned int mask)
+		void TestAckRangeHistory(unsigned int ack, int width, int runs, unsigned int max_sequence)
 		{
-			packet_loss_mask = mask;
-		}
-#endif
+			const int history = ReliabilitySystem::AckHistory;
+			std::vector<bool> received(history + 1);		// by distance back from the ack
+			if (runs == 0)
+				ReceiveBursts(received);
+			else
+				ReceiveRuns(received, runs);
+			PacketQueue receivedQueue(max_sequence, 2 * history);
+			PacketQueue pending(max_sequence, 2 * history);
+			PacketQueue acked(max_sequence, 2 * history);
+			PacketData data;
+			data.time = 0;
+			data.size = 1;
+			data.sequence = (ack - history) & max_sequence;
+			for (int back = history; back >= 0; --back, data.sequence = sequence_next(data.sequence, max_sequence))
+			{
+				pending.insert(data);
+				if (received[back])
+					receivedQueue.insert(data);
+			}
 
-	protected:
+			AckRange ranges[ReliabilitySystem::MaxAckRanges];
+			const int count = ReliabilitySystem::generate_ack_ranges(ack, receivedQueue, max_sequence, width, ranges, ReliabilitySystem::MaxAckRanges);
 
-		void WriteInteger(unsigned char* data, unsigned int value)
-		{
-			data[0] = (unsigned char)(value >> 24);
-			data[1] = (unsigned char)((value >> 16) & 0xFF);
-			data[2] = (unsigned char)((value >> 8) & 0xFF);
-			data[3] = (unsigned char)(value & 0xFF);
-		}
+			// newest first, each a whole run of received packets beyond the mask, and every run up to the last one taken
+			std::vector<bool> covered(history + 1);
+			unsigned int oldest = (unsigned int)width + 1;
+			for (int i = 0; i < count; ++i)
+			{
+				const unsigned int newest = sequence_distance(ack, ranges[i].first, max_sequence) - (ranges[i].count - 1);
+				const unsigned int last = newest + ranges[i].count - 1;
+				const bool inside = ranges[i].count > 0 && newest >= oldest && last <= (unsigned int)history;
+				Check(inside, "ack range bounds", ack);
+				if (!inside)
+					return;
+				Check(newest == (unsigned int)width + 1 || !received[newest - 1], "ack range starts a run", newest);
+				Check(last == (unsigned int)history || !received[last + 1], "ack range ends a run", last);
+				for (unsigned int back = oldest; back < newest; ++back)
+					Check(!received[back], "ack range skipped a run", back);
+				for (unsigned int back = newest; back <= last; ++back)
+				{
+					Check(received[back], "ack range covers a hole", back);
+					covered[back] = true;
+				}
+				oldest = last + 1;
+			}
+			if (count < ReliabilitySystem::MaxAckRanges)
+			{
+				for (unsigned int back = oldest; back <= (unsigned int)history; ++back)
+					Check(!received[back], "ack range missing", back);
+			}
 
-		void WriteHeader(unsigned char* header, unsigned int sequence, unsigned int ack, unsigned int ack_bits)
-		{
-			WriteInteger(header, sequence);
-			WriteInteger(header + 4, ack);
-			WriteInteger(header + 8, ack_bits);
+			std::vector<unsigned int> acked_sequences;
+			unsigned int acked_packets = 0;
+			RoundTripEstimator round_trip;
+			ReliabilitySystem::process_ack_ranges(ranges, count, pending, acked, acked_sequences, acked_packets, round_trip, 0, max_sequence);
+			unsigned int sequence = ack;
+			for (int back = 0; back <= history; ++back, sequence = sequence_prev(sequence, max_sequence))
+				Check(acked.exists(sequence) == covered[back] && pending.exists(sequence) == !covered[back], "ack range acked", sequence);
 		}
 
-		void ReadInteger(const unsigned char* data, unsigned int& value)
+		void TestAckRangeHeader(unsigned int ack, int width, unsigned int max_sequence)
 		{
-			value = (((unsigned int)data[0] << 24) | ((unsigned int)data[1] << 16) |
-				((unsigned int)data[2] << 8) | ((unsigned int)data[3]));
-		}
+			TestConnection sender(max_sequence);
+			TestConnection receiver(max_sequence);
+			sender.SetAckBits(width);
+			sender.SetAckRanges(true);
+			receiver.SetAckBits(width);
+			receiver.SetAckRanges(true);
+
+			unsigned char packet[ReliableConnection::MaxHeaderSize];
+			PacketView view;
+			sender.Read(packet, receiver.WritePacketHeader(packet, true), view);
+			Check(sender.HasAckRanges(), "ack ranges agreed", width);
+
+			ReliabilitySystem& reliability = sender.GetReliabilitySystem();
+			std::vector<bool> received(4 * width);
+			ReceiveBursts(received);
+			unsigned int sequence = (ack - (unsigned int)received.size() + 1) & max_sequence;
+			for (int back = (int)received.size() - 1; back >= 0; --back, sequence = sequence_next(sequence, max_sequence))
+			{
+				if (received[back])
+					reliability.PacketReceived(sequence, 1, 0);
+			}
 
-		void ReadHeader(const unsigned char* header, unsigned int& sequence, unsigned int& ack, unsigned int& ack_bits)
-		{
-			ReadInteger(header, sequence);
-			ReadInteger(header + 4, ack);
-			ReadInteger(header + 8, ack_bits);
+			const int size = sender.WritePacketHeader(packet, true);
+			unsigned int ack_bits[ReliabilitySystem::MaxAckWords];
+			int words = 1;
+			AckRange ranges[ReliabilitySystem::MaxAckRanges];
+			int range_count = 0;
+			view = PacketView();
+			view.data = packet;
+			view.size = size;
+			Check(receiver.ReadCompactHeader(view, ack_bits, words, ranges, range_count) == size && view.ack == ack, "ack range header", width);
+
+			AckRange expected[ReliabilitySystem::MaxAckRanges];
+			const int expected_count = reliability.GenerateAckRanges(expected, ReliabilitySystem::MaxAckRanges, width);
+			Check(expected_count > 0 && range_count == expected_count, "ack range header count", range_count);
+			for (int i = 0; i < range_count && i < expected_count; ++i)
+				Check(ranges[i].first == expected[i].first && ranges[i].count == expected[i].count, "ack range header range", i);
 		}
 
-		virtual void OnStop()
-		{
-			ClearData();
-		}
+		// a sequence cut to 1, 2 or 3 bytes is rebuilt as the nearest one to the sequence expected next, wherever
+		// that lies: around zero, around the wrap and around the half-space mark where more recent flips over
 
-		virtual void OnDisconnect()
+		void TestCompactSequence()
 		{
-			ClearData();
+			const unsigned int spaces[] = { 0xFFFF, 0x7FFFFFFF };
+			for (unsigned int max_sequence : spaces)
+			{
+				const unsigned int half = max_sequence / 2;
+				const unsigned int remotes[] = { 0, 1, 200, half - 1, half, half + 1, max_sequence - 200, max_sequence - 1, max_sequence };
+				for (unsigned int remote : remotes)
+				{
+					TestConnection connection(max_sequence);
+					connection.GetReliabilitySystem().PacketReceived(remote, 1, 0);
+					Check(connection.GetReliabilitySystem().GetRemoteSequence() == remote, "compact remote sequence", remote);
+					const unsigned int expected = sequence_next(remote, max_sequence);
+					for (int bytes = 1; bytes <= 3; ++bytes)
+					{
+						// the sender keeps its distance from what we have under half of what the bytes can tell apart
+						const long long reach = std::min(1ll << (bytes * 8 - 1), ((long long)max_sequence + 1) / 2);
+						const long long step = bytes == 1 ? 1 : 97;
+						for (long long offset = -reach + 1; offset < reach; offset = offset + step < reach - 1 || offset == reach - 1 ? offset + step : reach - 1)
+						{
+							const unsigned int sequence = (unsigned int)(expected + offset) & max_sequence;
+							unsigned char data[4];
+							for (int i = 0; i < bytes; ++i)
+								data[i] = (unsigned char)(sequence >> ((bytes - 1 - i) * 8));
+							Check(connection.ReadSequence(data, bytes) == sequence, "compact sequence", sequence);
+						}
+					}
+				}
+			}
 		}
 
-	private:
+		// two connections over a lossy link that wraps the sequence space several times
+		//  + every packet the receiver takes has the sequence it was sent with, and most go out cut short
+		//  + when the receiver starts over halfway, past the half-space mark where an ack of zero looks newer than
+		//    the sender's own, it drops cut short packets and owes an ack until the sender sends full sequences again
 
-		void ClearData()
+		void TestCompactLink()
 		{
-			reliabilitySystem.Reset();
+			const unsigned int max_sequence = 0xFFFF;
+			const int packets = 4 * (max_sequence + 1);
+			const int reset = 2 * (max_sequence + 1) + 0xA000;
+			TestConnection sender(max_sequence);
+			TestConnection* receiver = new TestConnection(max_sequence);
+			sender.SetCompactHeader(true);
+			receiver->SetCompactHeader(true);
+			ReliabilitySystem& reliability = sender.GetReliabilitySystem();
+			unsigned char packet[ReliableConnection::MaxHeaderSize + 1];
+			PacketView view;
+			int cut = 0;
+			int dropped = 0;
+			unsigned int acked = 0;
+			for (int i = 0; i < packets; ++i)
+			{
+				if (i == reset)
+				{
+					delete receiver;
+					receiver = new TestConnection(max_sequence);
+					receiver->SetCompactHeader(true);
+					acked = reliability.GetAckedPackets();
+				}
+				const unsigned int sequence = reliability.GetLocalSequence();
+				Check(sequence == ((unsigned int)i & max_sequence), "compact link sequence", i);
+				const int size = sender.Write(packet);
+				if ((packet[0] & 0x03) != 0x03)		// the low bits hold the bytes of the sequence sent, less one
+					cut++;
+				if (Random() % 10 != 0)
+				{
+					if (receiver->Read(packet, size, view))
+						Check(view.sequence == sequence, "compact link rebuilt", sequence);
+					else
+					{
+						Check(i >= reset && receiver->GetReliabilitySystem().GetReceivedPackets() == 0, "compact link taken", sequence);
+						Check(receiver->GetNextDeadline(GetTimestamp()) <= GetTimestamp(), "compact link ack owed", sequence);
+						dropped++;
+					}
+				}
+				// the receiver acks every few packets, and some acks are lost too
+				if (i % 4 == 3 && Random() % 10 != 0)
+					sender.Read(packet, receiver->WritePacketHeader(packet, true), view);
+				if (i % 16 == 15)
+					reliability.Update(GetTimestamp());
+			}
+			delete receiver;
+			Check(cut > packets * 8 / 10, "compact link cut short", cut);
+			Check(dropped > 0 && dropped < 16, "compact link dropped after reset", dropped);
+			Check(reliability.GetAckedPackets() - acked > (unsigned int)(packets - reset) * 7 / 10, "compact link acked after reset", reliability.GetAckedPackets() - acked);
 		}
 
-#ifdef NET_UNIT_TEST
-		unsigned int packet_loss_mask;			// mask sequence number, if non-zero, drop packet - for unit test only
-#endif
-
-		ReliabilitySystem reliabilitySystem;	// reliability system: manages sequence numbers and acks, tracks network stats etc.
+		int checks;
+		int failures;
+		unsigned int state;
 	};
+
+#endif
 }
 
 #endif
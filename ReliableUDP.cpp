@@ -1,266 +1,783 @@
-/*
-    Reliability and Flow Control Example
-    From "Networking for Game Programmers" - http://www.gaffer.org/networking-for-game-programmers
-    Author: Glenn Fiedler <gaffer@gaffer.org>
-*/
-
-#include <iostream>
-#include <fstream>
-#include <string>
-#include <vector>
-
-#include "Net.h"
-#include "md5.h"
-
-//#define SHOW_ACKS
-
-using namespace std;
-using namespace net;
-
-const int ServerPort = 30000;
-const int ClientPort = 30001;
-const int ProtocolId = 0x11223344;
-const float DeltaTime = 1.0f / 30.0f;
-const float SendRate = 1.0f / 30.0f;
-const float TimeOut = 10.0f;
-const int PacketSize = 256;
-
-class FlowControl
-{
-public:
-    FlowControl()
-    {
-        printf("flow control initialized\n");
-        Reset();
-    }
-
-    void Reset()
-    {
-        mode = Bad;
-        penalty_time = 4.0f;
-        good_conditions_time = 0.0f;
-        penalty_reduction_accumulator = 0.0f;
-    }
-
-    void Update(float deltaTime, float rtt)
-    {
-        const float RTT_Threshold = 250.0f;
-
-        if (mode == Good)
-        {
-            if (rtt > RTT_Threshold)
-            {
-                printf("*** dropping to bad mode ***\n");
-                mode = Bad;
-                if (good_conditions_time < 10.0f && penalty_time < 60.0f)
-                {
-                    penalty_time *= 2.0f;
-                    if (penalty_time > 60.0f)
-                        penalty_time = 60.0f;
-                    printf("penalty time increased to %.1f\n", penalty_time);
-                }
-                good_conditions_time = 0.0f;
-                penalty_reduction_accumulator = 0.0f;
-                return;
-            }
-
-            good_conditions_time += deltaTime;
-            penalty_reduction_accumulator += deltaTime;
-
-            if (penalty_reduction_accumulator > 10.0f && penalty_time > 1.0f)
-            {
-                penalty_time /= 2.0f;
-                if (penalty_time < 1.0f)
-                    penalty_time = 1.0f;
-                printf("penalty time reduced to %.1f\n", penalty_time);
-                penalty_reduction_accumulator = 0.0f;
-            }
-        }
-
-        if (mode == Bad)
-        {
-            if (rtt <= RTT_Threshold)
-                good_conditions_time += deltaTime;
-            else
-                good_conditions_time = 0.0f;
-
-            if (good_conditions_time > penalty_time)
-            {
-                printf("*** upgrading to good mode ***\n");
-                good_conditions_time = 0.0f;
-                penalty_reduction_accumulator = 0.0f;
-                mode = Good;
-                return;
-            }
-        }
-    }
-
-    float GetSendRate()
-    {
-        return mode == Good ? 30.0f : 10.0f;
-    }
-
-private:
-    enum Mode
-    {
-        Good,
-        Bad
-    };
-
-    Mode mode;
-    float penalty_time;
-    float good_conditions_time;
-    float penalty_reduction_accumulator;
-};
-
-// ----------------------------------------------
-
-int main(int argc, char* argv[])
-{
-    // parse command line
-    enum Mode
-    {
-        Client,
-        Server
-    };
-
-    Mode mode = Server;
-    Address address;
-    string fileName;
-
-    /*
-        Checks if we are running as a client or server.
-        When running as the client the system grabs file path we are sending and IP address of the server.
-    */
-    if (argc >= 2)
-    {
-        int a, b, c, d;
-#pragma warning(suppress : 4996)
-        if (sscanf(argv[1], "%d.%d.%d.%d", &a, &b, &c, &d))
-        {
-            mode = Client;
-            address = Address(a, b, c, d, ServerPort); // grabs the server IP address
-            fileName = argv[2]; // grabs file path to the file we are sending. 
-        }
-    }
-
-    // initialize
-    if (!InitializeSockets())
-    {
-        printf("failed to initialize sockets\n");
-        return 1;
-    }
-
-    ReliableConnection connection(ProtocolId, TimeOut);
-
-    const int port = mode == Server ? ServerPort : ClientPort;
-
-    if (!connection.Start(port))
-    {
-        printf("could not start connection on port %d\n", port);
-        return 1;
-    }
-
-    // ------------------------------
-    // Client Side: Send Metadata
-    // ------------------------------
-    if (mode == Client)
-    {
-        std::ifstream file;
-        file.open(fileName, std::ios::binary);
-        if (!file)
-        {
-            // error opening the file
-            printf("Error: could not open \"%s\". Please try again.\n", fileName.c_str());
-            return 0;
-        }
-        else // file opened successfully
-        {
-            // connects to the server
-            connection.Connect(address);
-
-            // grabs the file size from the file metadata
-            file.seekg(0, std::ios::end);              // this moves the file pointer to the end of the file
-            std::streamsize fileSize = file.tellg();   // this grabs the size of the file
-            file.seekg(0, std::ios::beg);              // moves file pointer back to start of file
-            // sends the file size to the server
-            connection.SendPacket(reinterpret_cast<unsigned char*>(&fileSize), sizeof(fileSize));
-
-            // reads the file into a buffer and creates the MD5 hash
-            vector<char> fileBuffer(fileSize);
-            file.read(fileBuffer.data(), fileSize);
-            MD5 md5;
-            md5.update(fileBuffer.data(), fileSize);
-            string fileHash = md5.finalize().hexdigest();
-            // sends the MD5 hash to the server
-            connection.SendPacket(reinterpret_cast<const unsigned char*>(fileHash.c_str()), fileHash.length());
-
-            // sends the file name to the server
-            connection.SendPacket(reinterpret_cast<const unsigned char*>(fileName.c_str()), fileName.length());
-
-            printf("Client sent metadata:\n");
-            printf("  File size: %lld bytes\n", (long long)fileSize);
-            printf("  MD5 hash: %s\n", fileHash.c_str());
-            printf("  File name: %s\n", fileName.c_str());
-        }
-    }
-    // ------------------------------
-    // Server Side: Receive Metadata
-    // ------------------------------
-    else // mode == Server
-    {
-        connection.Listen();
-        // wait until connected
-        while (!connection.IsConnected())
-        {
-            connection.Update(DeltaTime);
-            net::wait(DeltaTime);
-        }
-
-        // Variables to track metadata reception
-        bool fileSizeReceived = false;
-        bool hashReceived = false;
-        bool fileNameReceived = false;
-        std::streamsize fileSize = 0;
-        std::string fileHash;
-        std::string fileName;
-
-        // Loop until all metadata packets are received
-        while (!(fileSizeReceived && hashReceived && fileNameReceived))
-        {
-            // receive packets
-            unsigned char packet[PacketSize];
-            int bytes_read = connection.ReceivePacket(packet, sizeof(packet));
-            if (bytes_read > 0)
-            {
-                if (!fileSizeReceived)
-                {
-                    // first packet: file size (sent as binary)
-                    fileSize = *reinterpret_cast<std::streamsize*>(packet);
-                    printf("Received file size: %lld bytes\n", (long long)fileSize);
-                    fileSizeReceived = true;
-                }
-                else if (!hashReceived)
-                {
-                    // second packet: MD5 hash string
-                    fileHash = std::string(reinterpret_cast<char*>(packet), bytes_read);
-                    printf("Received MD5 hash: %s\n", fileHash.c_str());
-                    hashReceived = true;
-                }
-                else if (!fileNameReceived)
-                {
-                    // third packet: file name
-                    fileName = std::string(reinterpret_cast<char*>(packet), bytes_read);
-                    printf("Received file name: %s\n", fileName.c_str());
-                    fileNameReceived = true;
-                }
-            }
-            connection.Update(DeltaTime);
-            net::wait(DeltaTime);
-        }
-    }
-
-    ShutdownSockets();
-
-    return 0;
-}
+/*
+    Reliability and Flow Control Example
+    From "Networking for Game Programmers" - http://www.gaffer.org/networking-for-game-programmers
+    Author: Glenn Fiedler <gaffer@gaffer.org>
+*/
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <set>
+#include <cstdio>
+
+#include "Net.h"
+#include "md5.h"
+
+//#define SHOW_ACKS
+
+using namespace std;
+using namespace net;
+
+const int ServerPort = 30000;
+const int ClientPort = 30001;
+const int ProtocolId = 0x11223344;
+const float SendRate = 1.0f / 30.0f;
+const float TimeOut = 10.0f;
+const int PacketSize = 256;
+const int AckBits = 128;        // ack mask the client asks for
+const float LingerTime = 1.0f;
+const int AckFrequency = 2;     // the server acks on its own every this many chunks...
+const float AckDelay = 0.001f;  // ...or this long after a chunk arrived, whichever comes first
+const int ReceiveBudget = 256;
+
+/*
+    The original good/bad flow control as a congestion control policy. It picks a
+    packet rate from the round trip time alone, the window is that rate converted
+    to bytes in flight over one round trip.
+*/
+class FlowControl : public CongestionControl
+{
+public:
+    FlowControl()
+    {
+        printf("flow control initialized\n");
+        FlowControl::Reset();
+    }
+
+    virtual const char* GetName() const override
+    {
+        return "flow";
+    }
+
+    virtual void Reset() override
+    {
+        mode = Bad;
+        penalty_time = 4.0f;
+        good_conditions_time = 0.0f;
+        penalty_reduction_accumulator = 0.0f;
+        rtt = 0.0f;
+        lastUpdate = 0;
+    }
+
+    virtual void OnPacketAcked(const PacketData&, Timestamp) override {}
+    virtual void OnPacketLost(const PacketData&, Timestamp) override {}
+
+    virtual void OnUpdate(Timestamp now, float rtt) override
+    {
+        if (lastUpdate != 0)
+            Update(TimestampToSeconds(now - lastUpdate), rtt * 1000.0f);
+        lastUpdate = now;
+        this->rtt = rtt;
+    }
+
+    virtual int GetCongestionWindow() const override
+    {
+        return (int)(std::max(1.0f, GetSendRate() * rtt) * PacketSize);
+    }
+
+    virtual float GetPacingRate() const override
+    {
+        return GetSendRate() * PacketSize;
+    }
+
+    void Update(float deltaTime, float rtt)
+    {
+        const float RTT_Threshold = 250.0f;
+
+        if (mode == Good)
+        {
+            if (rtt > RTT_Threshold)
+            {
+                printf("*** dropping to bad mode ***\n");
+                mode = Bad;
+                if (good_conditions_time < 10.0f && penalty_time < 60.0f)
+                {
+                    penalty_time *= 2.0f;
+                    if (penalty_time > 60.0f)
+                        penalty_time = 60.0f;
+                    printf("penalty time increased to %.1f\n", penalty_time);
+                }
+                good_conditions_time = 0.0f;
+                penalty_reduction_accumulator = 0.0f;
+                return;
+            }
+
+            good_conditions_time += deltaTime;
+            penalty_reduction_accumulator += deltaTime;
+
+            if (penalty_reduction_accumulator > 10.0f && penalty_time > 1.0f)
+            {
+                penalty_time /= 2.0f;
+                if (penalty_time < 1.0f)
+                    penalty_time = 1.0f;
+                printf("penalty time reduced to %.1f\n", penalty_time);
+                penalty_reduction_accumulator = 0.0f;
+            }
+        }
+
+        if (mode == Bad)
+        {
+            if (rtt <= RTT_Threshold)
+                good_conditions_time += deltaTime;
+            else
+                good_conditions_time = 0.0f;
+
+            if (good_conditions_time > penalty_time)
+            {
+                printf("*** upgrading to good mode ***\n");
+                good_conditions_time = 0.0f;
+                penalty_reduction_accumulator = 0.0f;
+                mode = Good;
+                return;
+            }
+        }
+    }
+
+    float GetSendRate() const
+    {
+        return mode == Good ? 30.0f : 10.0f;
+    }
+
+private:
+    enum Mode
+    {
+        Good,
+        Bad
+    };
+
+    Mode mode;
+    float penalty_time;
+    float good_conditions_time;
+    float penalty_reduction_accumulator;
+    float rtt;                  // seconds, from the last update
+    Timestamp lastUpdate;
+};
+
+// congestion control policies the client can pick from the command line
+CongestionControl* CreateCongestionControl(const string& name)
+{
+    if (name == "cubic")
+        return new CubicCongestionControl(PacketSize);
+    if (name == "newreno")
+        return new NewRenoCongestionControl(PacketSize);
+    if (name == "bbr")
+        return new BbrCongestionControl(PacketSize);
+    if (name == "ledbat")
+        return new LedbatCongestionControl(PacketSize);
+    if (name == "flow")
+        return new FlowControl();
+    return NULL;
+}
+
+// ----------------------------------------------
+
+/*
+    File transfer protocol.
+    The first byte of every payload identifies what the packet carries:
+
+        metadata:   [type][file size (8)][md5 hex digest (32)][file name]
+        chunk:      [type][file offset (8)][file bytes]
+        keep alive: [type]
+
+    The server has nothing to send of its own, so it sends keep alive packets
+    to give the client's acks something to ride on.
+*/
+
+enum PacketType
+{
+    PacketKeepAlive = 0,
+    PacketMetadata = 1,
+    PacketChunk = 2
+};
+
+const int HashSize = 32;
+const int MetadataHeaderSize = 1 + 8 + HashSize;
+const int ChunkHeaderSize = 1 + 8;
+const int ChunkDataSize = PacketSize - ChunkHeaderSize;
+const unsigned long long MaxFileSize = 1ull << 30;  // the sender holds the whole file in memory
+
+void WriteUInt64(unsigned char* data, unsigned long long value)
+{
+    for (int i = 0; i < 8; i++)
+        data[i] = (unsigned char)(value >> (56 - i * 8));
+}
+
+unsigned long long ReadUInt64(const unsigned char* data)
+{
+    unsigned long long value = 0;
+    for (int i = 0; i < 8; i++)
+        value = (value << 8) | data[i];
+    return value;
+}
+
+/*
+    Splits a file into PacketSize bounded chunks and keeps as many of them in flight
+    as the connection's congestion window allows, never more than one ack can cover. Every
+    packet is sent reliably, so the chunks in flight are the payloads still waiting
+    in the connection's retransmit buffer. Chunks are only sent once the metadata has
+    been acked so the server always knows the file size before any data arrives.
+*/
+class FileSender
+{
+public:
+    FileSender()
+    {
+        fileSize = 0;
+        nextOffset = 0;
+        metadataSent = false;
+    }
+
+    bool Open(const string& path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+            return false;
+
+        // grabs the file size from the file metadata
+        file.seekg(0, std::ios::end);
+        fileSize = (unsigned long long)file.tellg();
+        file.seekg(0, std::ios::beg);
+        if (fileSize > MaxFileSize)
+            return false;
+
+        // reads the file into a buffer and creates the MD5 hash
+        fileData.resize((size_t)fileSize);
+        if (fileSize > 0)
+            file.read(reinterpret_cast<char*>(fileData.data()), fileSize);
+        MD5 md5;
+        md5.update(fileData.data(), (MD5::size_type)fileSize);
+        fileHash = md5.finalize().hexdigest();
+
+        // only the name travels, never the directory it was sent from
+        size_t slash = path.find_last_of("/\\");
+        fileName = slash == string::npos ? path : path.substr(slash + 1);
+        return true;
+    }
+
+    void SendPackets(ReliableConnection& connection)
+    {
+        unsigned char packet[PacketSize];
+
+        if (!metadataSent)
+        {
+            packet[0] = PacketMetadata;
+            WriteUInt64(&packet[1], fileSize);
+            std::memcpy(&packet[9], fileHash.c_str(), HashSize);
+            int nameSize = std::min((int)fileName.length(), PacketSize - MetadataHeaderSize);
+            std::memcpy(&packet[MetadataHeaderSize], fileName.c_str(), nameSize);
+            metadataSent = connection.SendReliablePacket(packet, MetadataHeaderSize + nameSize);
+            return;
+        }
+
+        // the metadata is the only thing sent before the first chunk, so it is acked once nothing is pending
+        if (nextOffset == 0 && connection.GetPendingReliablePackets() > 0)
+            return;
+
+        // the whole window goes out in as few system calls as possible. each chunk is built straight into
+        // the pooled buffer the connection sends and resends it from, so the file data is copied just once
+        connection.BeginSendBatch();
+        while (connection.GetPendingReliablePackets() < connection.GetAckWindow() && nextOffset < fileSize)
+        {
+            int size = (int)std::min((unsigned long long)ChunkDataSize, fileSize - nextOffset);
+            if (!connection.CanSendPacket(ChunkHeaderSize + size))
+                break;
+            PacketPool::Buffer* buffer = connection.AcquireBuffer();
+            unsigned char* chunk = buffer->GetPayload();
+            chunk[0] = PacketChunk;
+            WriteUInt64(&chunk[1], nextOffset);
+            std::memcpy(&chunk[ChunkHeaderSize], &fileData[(size_t)nextOffset], size);
+            buffer->size = ChunkHeaderSize + size;
+            if (!connection.SendReliableBuffer(buffer))
+                break;
+            nextOffset += size;
+        }
+        connection.EndSendBatch();
+    }
+
+    // when SendPackets next has something to do without waiting for an ack
+    Timestamp GetNextSendTime(const ReliableConnection& connection) const
+    {
+        if (!metadataSent)
+            return 0;
+        if (nextOffset >= fileSize || connection.GetPendingReliablePackets() >= connection.GetAckWindow())
+            return NoDeadline;
+        if (nextOffset == 0 && connection.GetPendingReliablePackets() > 0)
+            return NoDeadline;
+        return connection.GetNextSendTime(PacketSize);
+    }
+
+    // a connection that timed out has dropped its retransmit buffer, so nothing pending means nothing there
+    bool IsComplete(const ReliableConnection& connection) const
+    {
+        return metadataSent && nextOffset >= fileSize && connection.IsConnected() && connection.GetPendingReliablePackets() == 0;
+    }
+
+    const string& GetFileName() const { return fileName; }
+    const string& GetFileHash() const { return fileHash; }
+    unsigned long long GetFileSize() const { return fileSize; }
+
+private:
+    vector<unsigned char> fileData;
+    string fileName;
+    string fileHash;
+    unsigned long long fileSize;
+    unsigned long long nextOffset;      // offset of the next chunk that has never been sent
+    bool metadataSent;
+};
+
+/*
+    Reassembles chunks by offset. Duplicates are ignored so a chunk may safely
+    arrive more than once.
+
+    Chunks are written straight to a partial file at their offset, so memory does
+    not grow with the size the sender claims. The MD5 hash is computed as the file
+    fills in from the front: chunks that arrive ahead of a gap are only remembered
+    by offset, and read back from the file once the gap is filled.
+*/
+class FileReceiver
+{
+public:
+    FileReceiver()
+    {
+        metadataReceived = false;
+        failed = false;
+        finished = false;
+        fileSize = 0;
+        hashedBytes = 0;
+    }
+
+    ~FileReceiver()
+    {
+        // a transfer that never finished leaves nothing behind
+        if (file.is_open())
+        {
+            file.close();
+            std::remove(partName.c_str());
+        }
+    }
+
+    void ProcessPacket(const unsigned char* packet, int size)
+    {
+        if (size < 1 || failed)
+            return;
+
+        if (packet[0] == PacketMetadata && size >= MetadataHeaderSize)
+        {
+            if (metadataReceived)
+                return;
+            fileSize = ReadUInt64(&packet[1]);
+            if (fileSize > MaxFileSize)
+            {
+                printf("Error: refusing a %lld byte file\n", (long long)fileSize);
+                failed = true;
+                return;
+            }
+            fileHash = string(reinterpret_cast<const char*>(&packet[9]), HashSize);
+            fileName = string(reinterpret_cast<const char*>(&packet[MetadataHeaderSize]), size - MetadataHeaderSize);
+
+            // never trust a path from the wire
+            size_t slash = fileName.find_last_of("/\\");
+            outputName = slash == string::npos ? fileName : fileName.substr(slash + 1);
+            // other sessions may be receiving a file of the same name
+            static unsigned int partCount = 0;
+            partName = outputName + "." + std::to_string(++partCount) + ".part";
+            file.open(partName, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+            if (!file)
+            {
+                printf("Error: could not write \"%s\"\n", partName.c_str());
+                failed = true;
+                return;
+            }
+            metadataReceived = true;
+            printf("Received file size: %lld bytes\n", (long long)fileSize);
+            printf("Received MD5 hash: %s\n", fileHash.c_str());
+            printf("Received file name: %s\n", fileName.c_str());
+        }
+        else if (packet[0] == PacketChunk && size > ChunkHeaderSize && metadataReceived)
+        {
+            unsigned long long offset = ReadUInt64(&packet[1]);
+            int dataSize = size - ChunkHeaderSize;
+            // every chunk but the last is full, so anything else is not a chunk of this file
+            if (offset % ChunkDataSize != 0 || offset >= fileSize || (unsigned long long)dataSize != std::min((unsigned long long)ChunkDataSize, fileSize - offset))
+                return;
+            if (offset < hashedBytes || aheadChunks.count(offset))
+                return;
+            file.seekp((std::streamoff)offset);
+            file.write(reinterpret_cast<const char*>(&packet[ChunkHeaderSize]), dataSize);
+            if (!file)
+            {
+                printf("Error: could not write \"%s\"\n", partName.c_str());
+                failed = true;
+                return;
+            }
+            if (offset != hashedBytes)
+            {
+                // the sender never gets this far ahead of a missing chunk
+                if (aheadChunks.size() >= MaxAheadChunks)
+                {
+                    printf("Error: too many chunks ahead of offset %lld\n", (long long)hashedBytes);
+                    failed = true;
+                    return;
+                }
+                aheadChunks.insert(offset);
+                return;
+            }
+            md5.update(&packet[ChunkHeaderSize], (MD5::size_type)dataSize);
+            hashedBytes += dataSize;
+            HashAheadChunks();
+        }
+    }
+
+    bool IsComplete() const
+    {
+        return metadataReceived && !failed && hashedBytes == fileSize;
+    }
+
+    // the metadata asked for a file this receiver can't hold, or it could not be written
+    bool HasFailed() const
+    {
+        return failed;
+    }
+
+    // verifies the MD5 hash and moves the partial file to its real name in the working directory
+    bool Finish()
+    {
+        if (finished || !IsComplete())
+            return false;
+        finished = true;
+        file.close();
+        string hash = md5.finalize().hexdigest();
+        if (hash != fileHash)
+        {
+            printf("MD5 mismatch: expected %s, got %s\n", fileHash.c_str(), hash.c_str());
+            std::remove(partName.c_str());
+            return false;
+        }
+        // rename won't replace an existing file everywhere
+        std::remove(outputName.c_str());
+        if (std::rename(partName.c_str(), outputName.c_str()) != 0)
+        {
+            printf("Error: could not write \"%s\"\n", outputName.c_str());
+            std::remove(partName.c_str());
+            return false;
+        }
+        printf("File \"%s\" received and verified (%lld bytes)\n", outputName.c_str(), (long long)fileSize);
+        return true;
+    }
+
+private:
+    static const size_t MaxAheadChunks = 1 << 16;
+
+    // chunks that arrived ahead of a gap join the hash once it is filled
+    void HashAheadChunks()
+    {
+        unsigned char data[ChunkDataSize];
+        std::set<unsigned long long>::iterator next;
+        while ((next = aheadChunks.find(hashedBytes)) != aheadChunks.end())
+        {
+            const int dataSize = (int)std::min((unsigned long long)ChunkDataSize, fileSize - hashedBytes);
+            file.seekg((std::streamoff)hashedBytes);
+            if (!file.read(reinterpret_cast<char*>(data), dataSize))
+            {
+                printf("Error: could not read back \"%s\"\n", partName.c_str());
+                failed = true;
+                return;
+            }
+            md5.update(data, (MD5::size_type)dataSize);
+            hashedBytes += dataSize;
+            aheadChunks.erase(next);
+        }
+    }
+
+    bool metadataReceived;
+    bool failed;
+    bool finished;
+    unsigned long long fileSize;
+    unsigned long long hashedBytes;             // the file is complete and hashed up to here
+    string fileHash;
+    string fileName;
+    string outputName;
+    string partName;
+    std::fstream file;
+    MD5 md5;
+    std::set<unsigned long long> aheadChunks;   // offsets of chunks written past hashedBytes
+};
+
+/*
+    Server side state for one client upload. Each session is a reliable connection
+    attached to the server's shared socket, so it has its own sequence numbers, acks
+    and timeout alongside its own FileReceiver.
+*/
+class TransferSession : public ReliableConnection
+{
+public:
+    TransferSession(unsigned int protocolId, float timeout)
+        : ReliableConnection(protocolId, timeout)
+    {
+        // accept whatever ack width the client asks for, and ack ranges if it wants them
+        SetAckBits(ReliabilitySystem::MaxAckBits);
+        SetAckRanges(true);
+        SetCompactHeader(true);
+        // the server hardly sends anything, so acks go out in packets of their own
+        SetAckDelay(AckFrequency, AckDelay);
+        finished = false;
+        nextKeepAlive = 0;
+        lingerDeadline = NoDeadline;
+    }
+
+    void ProcessPacket(const unsigned char* packet, int size)
+    {
+        receiver.ProcessPacket(packet, size);
+    }
+
+    // the server only updates sessions with something to do, so the session looks after itself here and stops
+    // once it is done, which has the server remove it
+    virtual void Update(float deltaTime) override
+    {
+        ReliableConnection::Update(deltaTime);
+        if (IsConnected() && !Service(GetTimestamp()))
+            Stop();
+    }
+
+    virtual Timestamp GetNextDeadline(Timestamp now) const override
+    {
+        return std::min(ReliableConnection::GetNextDeadline(now), std::min(nextKeepAlive, lingerDeadline));
+    }
+
+private:
+    // finishes the file once it is complete and keeps the client alive.
+    // returns false once the session is done
+    bool Service(Timestamp now)
+    {
+        if (receiver.HasFailed())
+            return false;
+
+        if (!finished && receiver.IsComplete())
+        {
+            receiver.Finish();
+            finished = true;
+            // keep acking for a while after the last chunk so the client sees its final acks
+            lingerDeadline = now + SecondsToTimestamp(LingerTime);
+        }
+
+        if (now >= lingerDeadline)
+            return false;
+
+        // the acks look after themselves, this only keeps the connection alive while the client has nothing to send
+        if (now >= nextKeepAlive)
+        {
+            unsigned char keepAlive = PacketKeepAlive;
+            SendPacket(&keepAlive, 1);
+            nextKeepAlive = now + SecondsToTimestamp(SendRate);
+        }
+        return true;
+    }
+
+    FileReceiver receiver;
+    bool finished;
+    Timestamp nextKeepAlive;
+    Timestamp lingerDeadline;
+};
+
+// ----------------------------------------------
+
+int main(int argc, char* argv[])
+{
+#ifdef NET_UNIT_TEST
+    if (argc >= 2 && string(argv[1]) == "--unit-test")
+        return UnitTest::Run() ? 0 : 1;
+#endif
+
+    // parse command line
+    enum Mode
+    {
+        Client,
+        Server
+    };
+
+    Mode mode = Server;
+    Address address;
+    string fileName;
+    bool offload = false;
+    bool txtime = false;
+    int ackBits = AckBits;
+    bool ackRanges = true;
+    bool compactHeader = true;
+    string congestionName = "cubic";
+
+    /*
+        Checks if we are running as a client or server.
+        When running as the client the system grabs file path we are sending and IP address of the server.
+    */
+    if (argc >= 2)
+    {
+        int a, b, c, d;
+#pragma warning(suppress : 4996)
+        if (sscanf(argv[1], "%d.%d.%d.%d", &a, &b, &c, &d))
+        {
+            mode = Client;
+            address = Address(a, b, c, d, ServerPort); // grabs the server IP address
+            fileName = argv[2]; // grabs file path to the file we are sending. 
+        }
+    }
+
+    // optional flags may follow on either side
+    for (int i = 1; i < argc; ++i)
+    {
+        if (string(argv[i]) == "--offload")
+            offload = true;     // udp segmentation offload (linux only)
+        else if (string(argv[i]) == "--txtime")
+            txtime = true;      // kernel paced departures, needs the fq qdisc (linux only)
+        else if (string(argv[i]) == "--congestion" && i + 1 < argc)
+            congestionName = argv[++i];
+        else if (string(argv[i]) == "--ack-bits" && i + 1 < argc)
+            ackBits = atoi(argv[++i]);
+        else if (string(argv[i]) == "--no-ack-ranges")
+            ackRanges = false;  // acks only carry the mask
+        else if (string(argv[i]) == "--standard-header")
+            compactHeader = false;  // fixed 12 byte reliability header
+        else if (string(argv[i]) == "--background")
+            congestionName = "ledbat";  // only use capacity nobody else wants
+    }
+
+    // initialize
+    if (!InitializeSockets())
+    {
+        printf("failed to initialize sockets\n");
+        return 1;
+    }
+
+    // sleeps until a packet arrives or the next deadline passes, instead of ticking at a fixed rate
+    SocketWaiter waiter;
+    Timestamp lastTime = GetTimestamp();
+
+    // ------------------------------
+    // Client Side: Send File
+    // ------------------------------
+    if (mode == Client)
+    {
+        FileSender sender;
+        if (!sender.Open(fileName))
+        {
+            // error opening the file
+            printf("Error: could not open \"%s\". Please try again.\n", fileName.c_str());
+            return 0;
+        }
+
+        // declared before the connection so it outlives it
+        std::unique_ptr<CongestionControl> congestion(CreateCongestionControl(congestionName));
+        if (!congestion)
+        {
+            printf("Error: unknown congestion control \"%s\", use cubic, newreno, bbr, ledbat or flow\n", congestionName.c_str());
+            return 1;
+        }
+
+        if (ackBits != 32 && ackBits != 64 && ackBits != 128 && ackBits != 256)
+        {
+            printf("Error: --ack-bits must be 32, 64, 128 or 256\n");
+            return 1;
+        }
+
+        ReliableConnection connection(ProtocolId, TimeOut);
+        connection.SetCongestionControl(congestion.get());
+        connection.SetAckBits(ackBits);
+        connection.SetAckRanges(ackRanges);
+        connection.SetCompactHeader(compactHeader);
+
+        // another client on this machine may hold the usual port, in which case any free port will do
+        if (!connection.Start(ClientPort) && !connection.Start(0))
+        {
+            printf("could not start connection on port %d\n", ClientPort);
+            return 1;
+        }
+
+        if (offload && !connection.EnableOffload())
+            printf("udp segmentation offload not available, sending datagrams one by one\n");
+
+        if (txtime && !connection.EnableTxTime())
+            printf("SO_TXTIME not available, pacing in user space\n");
+
+        if (!waiter.Open(connection.GetSocket()))
+            return 1;
+
+        // connects to the server
+        connection.Connect(address);
+
+        printf("Client sending file:\n");
+        printf("  File size: %lld bytes\n", (long long)sender.GetFileSize());
+        printf("  MD5 hash: %s\n", sender.GetFileHash().c_str());
+        printf("  File name: %s\n", sender.GetFileName().c_str());
+        printf("  Congestion control: %s\n", congestion->GetName());
+
+        while (true)
+        {
+            // the server only sends keep alives, all we want from them are the acks
+            connection.ReceivePackets([](const unsigned char*, int) {}, ReceiveBudget);
+
+            const Timestamp now = GetTimestamp();
+            connection.Update(TimestampToSeconds(now - lastTime));
+            lastTime = now;
+
+            if (sender.IsComplete(connection))
+            {
+                printf("Client finished sending file (%u packets resent, %u tail probes)\n",
+                    connection.GetResentPackets(), connection.GetProbePackets());
+                break;
+            }
+
+            if (!connection.IsConnecting() && !connection.IsConnected())
+            {
+                printf("Error: connection to server lost\n");
+                break;
+            }
+
+            // acks processed by the update above may have opened the window
+            sender.SendPackets(connection);
+
+            // the pacer may want us back before anything arrives
+            waiter.Wait(std::min(connection.GetNextDeadline(now), sender.GetNextSendTime(connection)));
+        }
+    }
+    // ------------------------------
+    // Server Side: Receive Files
+    // ------------------------------
+    else // mode == Server
+    {
+        ConnectionManager<TransferSession> server(ProtocolId, TimeOut);
+
+        if (!server.Start(ServerPort))
+        {
+            printf("could not start server on port %d\n", ServerPort);
+            return 1;
+        }
+
+        if (offload && !server.EnableOffload())
+            printf("udp segmentation offload not available, sending datagrams one by one\n");
+
+        if (!waiter.Open(server.GetSocket()))
+            return 1;
+
+        printf("server listening for connections\n");
+
+        while (true)
+        {
+            // receive everything that arrived since the last update, up to the budget
+            server.ReceivePackets([](TransferSession& session, const unsigned char* packet, int size)
+            {
+                session.ProcessPacket(packet, size);
+            }, ReceiveBudget);
+
+            // sessions that received something or reached a deadline finish their files and send keep alives here
+            const Timestamp now = GetTimestamp();
+            server.Update(now);
+
+            waiter.Wait(server.GetNextDeadline(now));
+        }
+    }
+
+    ShutdownSockets();
+
+    return 0;
+}